@@ -0,0 +1,86 @@
+#include <Arduino.h>
+#include "acktrack.h"
+
+static ackrecord_t table[ACK_SLOTS];
+static uint16_t count = 0;  // number of records in table[]
+
+const uint16_t ackBucketLimits[ACK_BUCKETS - 1] = {50, 100, 200, 500, 1000, 2000};
+
+ackLatency_t ackLatency[DT_COUNT];
+
+static void removeRecord(uint16_t n) {
+  count--;
+  table[n] = table[count];  // order does not matter
+}
+
+bool ackPush(const ackrecord_t& rec) {
+  bool result = true;
+  for (uint16_t n = 0; n < count; n++) {
+    if (table[n].index == rec.index) {
+      ackLatency[table[n].type].replaced++;
+      uint8_t prevStatus = table[n].prevStatus;
+      int16_t prevXstatus = table[n].prevXstatus;
+      table[n] = rec;
+      table[n].prevStatus = prevStatus;
+      table[n].prevXstatus = prevXstatus;
+      return true;
+    }
+  }
+  if (count >= ACK_SLOTS) {
+    uint16_t oldest = 0;
+    for (uint16_t n = 1; n < count; n++) {
+      if (rec.time - table[n].time > rec.time - table[oldest].time)
+        oldest = n;
+    }
+    ackLatency[table[oldest].type].timedOut++;
+    removeRecord(oldest);
+    result = false;
+  }
+  table[count] = rec;
+  count++;
+  return result;
+}
+
+ackrecord_t* ackFind(uint16_t index) {
+  for (uint16_t n = 0; n < count; n++) {
+    if (table[n].index == index)
+      return &table[n];
+  }
+  return NULL;
+}
+
+uint32_t ackDone(uint16_t index, uint32_t now) {
+  for (uint16_t n = 0; n < count; n++) {
+    if (table[n].index == index) {
+      uint32_t latency = now - table[n].time;
+      ackLatency_t& stats = ackLatency[table[n].type];
+      uint16_t bucket = 0;
+      while (bucket < ACK_BUCKETS - 1 && latency >= ackBucketLimits[bucket])
+        bucket++;
+      stats.counts[bucket]++;
+      stats.acked++;
+      stats.totalLatency += latency;
+      if (latency > stats.maxLatency)
+        stats.maxLatency = latency;
+      removeRecord(n);
+      return latency;
+    }
+  }
+  return 0;
+}
+
+bool ackExpired(uint32_t now, uint32_t timeout, ackrecord_t& rec) {
+  for (uint16_t n = 0; n < count; n++) {
+    if (now - table[n].time > timeout) {
+      rec = table[n];
+      ackLatency[rec.type].timedOut++;
+      removeRecord(n);
+      return true;
+    }
+  }
+  return false;
+}
+
+uint16_t ackPending(void) {
+  return count;
+}
@@ -0,0 +1,69 @@
+#ifndef ACKTRACK_H
+#define ACKTRACK_H
+
+#include <Arduino.h>
+#include "devices.h"
+
+/*
+ * Acknowledgement of commands
+ *
+ * When a command is published, the device immediately shows the status
+ * it should have once Domoticz has performed the command. A record of
+ * that expected status, and of the status to restore if the command is
+ * not acknowledged, is held in this small fixed size table until the
+ * status message from Domoticz is received or until it times out. The
+ * time between the command and its acknowledgement is added to a
+ * latency histogram kept for each device type. Nothing is allocated
+ * on the heap.
+ */
+
+#define ACK_SLOTS   8  // maximum number of commands waiting for an acknowledgement
+#define ACK_BUCKETS 7  // number of latency histogram buckets
+
+typedef struct {
+  uint16_t index;       // index of the device in devices[]
+  uint8_t type;         // devtype_t of the device
+  uint8_t status;       // expected status of the device
+  int16_t xstatus;      // expected extra status, -1 if any value is accepted
+  uint8_t prevStatus;   // status to restore if the command is not acknowledged
+  int16_t prevXstatus;  // extra status to restore if the command is not acknowledged
+  uint32_t time;        // millis() when the command was published
+} ackrecord_t;
+
+typedef struct {
+  uint32_t acked;             // acknowledged commands
+  uint32_t timedOut;          // commands not acknowledged in time
+  uint32_t replaced;          // commands replaced by a newer one before being acknowledged
+  uint32_t totalLatency;      // sum of the latencies of acknowledged commands (ms)
+  uint32_t maxLatency;        // longest latency (ms)
+  uint32_t counts[ACK_BUCKETS]; // latency histogram
+} ackLatency_t;
+
+// Upper limit (ms, exclusive) of each histogram bucket except the last one
+// which holds all the longer latencies
+extern const uint16_t ackBucketLimits[ACK_BUCKETS - 1];
+
+// Latency statistics indexed by devtype_t
+extern ackLatency_t ackLatency[DT_COUNT];
+
+// Adds the record of a published command. A record for the same device
+// is replaced, but its status to restore is kept. When the table is full,
+// the oldest record is dropped, counted as timed out, and false is returned.
+bool ackPush(const ackrecord_t& rec);
+
+// Returns the record of the command waiting for an acknowledgement for
+// devices[index] or NULL if there is none.
+ackrecord_t* ackFind(uint16_t index);
+
+// Removes the record for devices[index] and adds the time elapsed since
+// the command was published to the latency statistics. Returns that time.
+uint32_t ackDone(uint16_t index, uint32_t now);
+
+// Removes a record published more than timeout ms before now and copies
+// it into rec. Returns false if there are no such records.
+bool ackExpired(uint32_t now, uint32_t timeout, ackrecord_t& rec);
+
+// Number of commands waiting for an acknowledgement
+uint16_t ackPending(void);
+
+#endif
@@ -7,6 +7,7 @@
 #include <ArduinoJson.h>
 #include "config.h"
 #include "logging.h"
+#include "resolver.h"
 
 #define MAX_EEPROM_SIZE 4096
 
@@ -72,6 +73,27 @@ void useDefaultConfig(void) {
 
   config.logLevelUart = LOG_LEVEL_UART;
   config.logLevelSyslog = LOG_LEVEL_SYSLOG;
+
+  config.mqttSubscribeMode = MQTT_SUBSCRIBE_MODE;
+  strlcpy(config.mqttIdxTopic, DOMO_IDX_TOPIC, TOPIC_SZ);
+  config.mqttStreaming = MQTT_STREAMING;
+  config.mqttSyncWindow = MQTT_SYNC_WINDOW;
+  strlcpy(config.domoHost, DOMO_HOST, URL_SZ);
+  config.domoPort = DOMO_PORT;
+  config.domoBootstrap = DOMO_BOOTSTRAP;
+  strlcpy(config.mqttStateTopic, DOMO_STATE_TOPIC, TOPIC_SZ);
+  config.mqttPersistent = MQTT_PERSISTENT;
+  config.mqttCmdExpiry = MQTT_CMD_EXPIRY*1000;
+  config.liveDimRate = LIVE_DIM_RATE;
+  strlcpy(config.mqttHost2, MQTT_HOST2, URL_SZ);
+  config.mqttPort2 = MQTT_PORT2;
+  strlcpy(config.mqttHost3, MQTT_HOST3, URL_SZ);
+  config.mqttPort3 = MQTT_PORT3;
+  config.mqttTls = MQTT_TLS;
+  strlcpy(config.mqttFingerprint, MQTT_FINGERPRINT, FINGERPRINT_SZ);
+  config.mdnsDiscovery = MDNS_DISCOVERY;
+  config.wifiFastConnect = WIFI_FAST_CONNECT;
+  config.wifiSleep = WIFI_SLEEP;
  
   config.checksum = getConfigHash();
   sendToLogPf(LOG_DEBUG, PSTR("Using default config, checksum = 0x%x08"), config.checksum);
@@ -193,7 +215,12 @@ bool loadJsonConfig(String& filecontent) {
   bool result = false;
 
   String configFile = String(config.otaUrlBase) + config.hostname + ".config.json";
-  String configURL = String("http://") + config.otaHost + ":" + config.otaPort;
+  IPAddress otaIp;
+  if (waitForHost(config.otaHost, otaIp, RESOLVER_WAIT) != HOST_RESOLVED) {
+    sendToLogPf(LOG_ERR, PSTR("Could not resolve %s"), config.otaHost);
+    return false;
+  }
+  String configURL = String("http://") + otaIp.toString() + ":" + config.otaPort;
   //Serial.printf("Request %s%s\n", configURL.c_str(), configFile.c_str());
 
   if (httpClient.begin(wifiClient, configURL + configFile)) {
@@ -257,6 +284,27 @@ bool updateConfig(void) {
   if (obtainJsonLevel(doc, (char*) "logLevelUart", (uint8_t*) &numb)) config.logLevelUart = numb;
   if (obtainJsonLevel(doc, (char*) "logLevelSyslog", (uint8_t*) &numb)) config.logLevelSyslog = numb;    
 
+  if (obtainJsonInt(doc, (char*) "mqttSubscribeMode", &numb)) config.mqttSubscribeMode = numb;
+  obtainJsonStr(doc, (char*) "mqttIdxTopic", (char*) &config.mqttIdxTopic, TOPIC_SZ);
+  if (obtainJsonInt(doc, (char*) "mqttStreaming", &numb)) config.mqttStreaming = numb;
+  if (obtainJsonInt(doc, (char*) "mqttSyncWindow", &numb) && numb > 0) config.mqttSyncWindow = numb;
+  obtainJsonStr(doc, (char*) "domoHost", (char*) &config.domoHost, URL_SZ);
+  if (obtainJsonInt(doc, (char*) "domoPort", &numb)) config.domoPort = numb;
+  if (obtainJsonInt(doc, (char*) "domoBootstrap", &numb)) config.domoBootstrap = numb;
+  obtainJsonStr(doc, (char*) "mqttStateTopic", (char*) &config.mqttStateTopic, TOPIC_SZ);
+  if (obtainJsonInt(doc, (char*) "mqttPersistent", &numb)) config.mqttPersistent = numb;
+  if (obtainJsonInt(doc, (char*) "mqttCmdExpiry", &numb)) config.mqttCmdExpiry = numb*1000;
+  if (obtainJsonInt(doc, (char*) "liveDimRate", &numb)) config.liveDimRate = numb;
+  obtainJsonStr(doc, (char*) "mqttHost2", (char*) &config.mqttHost2, URL_SZ);
+  if (obtainJsonInt(doc, (char*) "mqttPort2", &numb)) config.mqttPort2 = numb;
+  obtainJsonStr(doc, (char*) "mqttHost3", (char*) &config.mqttHost3, URL_SZ);
+  if (obtainJsonInt(doc, (char*) "mqttPort3", &numb)) config.mqttPort3 = numb;
+  if (obtainJsonInt(doc, (char*) "mqttTls", &numb)) config.mqttTls = numb;
+  obtainJsonStr(doc, (char*) "mqttFingerprint", (char*) &config.mqttFingerprint, FINGERPRINT_SZ);
+  if (obtainJsonInt(doc, (char*) "mdnsDiscovery", &numb)) config.mdnsDiscovery = numb;
+  if (obtainJsonInt(doc, (char*) "wifiFastConnect", &numb)) config.wifiFastConnect = numb;
+  if (obtainJsonInt(doc, (char*) "wifiSleep", &numb)) config.wifiSleep = numb;
+
   if (getConfigHash() != config.checksum) {
     config.checksum = getConfigHash();
     /// do some sanity verifications ?
@@ -301,6 +349,26 @@ void dumpConfig(config_t * cfg, char * msg) {
   Serial.printf("  mqttUpdateTime: %d\n", cfg->mqttUpdateTime);
   Serial.printf("  logLevelUart: %d\n", cfg->logLevelUart);
   Serial.printf("  logLevelSyslog: %d\n", cfg->logLevelSyslog);
+  Serial.printf("  mqttSubscribeMode: %d\n", cfg->mqttSubscribeMode);
+  Serial.printf("  mqttIdxTopic: \"%s\"\n", cfg->mqttIdxTopic);
+  Serial.printf("  mqttStreaming: %d\n", cfg->mqttStreaming);
+  Serial.printf("  mqttSyncWindow: %d\n", cfg->mqttSyncWindow);
+  Serial.printf("  domoHost: \"%s\"\n", cfg->domoHost);
+  Serial.printf("  domoPort: %d\n", cfg->domoPort);
+  Serial.printf("  domoBootstrap: %d\n", cfg->domoBootstrap);
+  Serial.printf("  mqttStateTopic: \"%s\"\n", cfg->mqttStateTopic);
+  Serial.printf("  mqttPersistent: %d\n", cfg->mqttPersistent);
+  Serial.printf("  mqttCmdExpiry: %d\n", cfg->mqttCmdExpiry);
+  Serial.printf("  liveDimRate: %d\n", cfg->liveDimRate);
+  Serial.printf("  mqttHost2: \"%s\"\n", cfg->mqttHost2);
+  Serial.printf("  mqttPort2: %d\n", cfg->mqttPort2);
+  Serial.printf("  mqttHost3: \"%s\"\n", cfg->mqttHost3);
+  Serial.printf("  mqttPort3: %d\n", cfg->mqttPort3);
+  Serial.printf("  mqttTls: %d\n", cfg->mqttTls);
+  Serial.printf("  mqttFingerprint: \"%s\"\n", cfg->mqttFingerprint);
+  Serial.printf("  mdnsDiscovery: %d\n", cfg->mdnsDiscovery);
+  Serial.printf("  wifiFastConnect: %d\n", cfg->wifiFastConnect);
+  Serial.printf("  wifiSleep: %d\n", cfg->wifiSleep);
   Serial.printf("  checksum: 0x%08X\n", cfg->checksum);
 }  
 
@@ -326,7 +394,27 @@ void dumpConfigJson(config_t * cfg, char * msg) {
   Serial.printf("  \"infoTime\": %d,\n", cfg->infoTime);
   Serial.printf("  \"mqttUpdateTime\": %d,\n", cfg->mqttUpdateTime);
   Serial.printf("  \"logLevelUart\": %d,\n", cfg->logLevelUart);
-  Serial.printf("  \"logLevelSyslog\": %d\n", cfg->logLevelSyslog);
+  Serial.printf("  \"logLevelSyslog\": %d,\n", cfg->logLevelSyslog);
+  Serial.printf("  \"mqttSubscribeMode\": %d,\n", cfg->mqttSubscribeMode);
+  Serial.printf("  \"mqttIdxTopic\": \"%s\",\n", cfg->mqttIdxTopic);
+  Serial.printf("  \"mqttStreaming\": %d,\n", cfg->mqttStreaming);
+  Serial.printf("  \"mqttSyncWindow\": %d,\n", cfg->mqttSyncWindow);
+  Serial.printf("  \"domoHost\": \"%s\",\n", cfg->domoHost);
+  Serial.printf("  \"domoPort\": %d,\n", cfg->domoPort);
+  Serial.printf("  \"domoBootstrap\": %d,\n", cfg->domoBootstrap);
+  Serial.printf("  \"mqttStateTopic\": \"%s\",\n", cfg->mqttStateTopic);
+  Serial.printf("  \"mqttPersistent\": %d,\n", cfg->mqttPersistent);
+  Serial.printf("  \"mqttCmdExpiry\": %d,\n", cfg->mqttCmdExpiry);
+  Serial.printf("  \"liveDimRate\": %d,\n", cfg->liveDimRate);
+  Serial.printf("  \"mqttHost2\": \"%s\",\n", cfg->mqttHost2);
+  Serial.printf("  \"mqttPort2\": %d,\n", cfg->mqttPort2);
+  Serial.printf("  \"mqttHost3\": \"%s\",\n", cfg->mqttHost3);
+  Serial.printf("  \"mqttPort3\": %d,\n", cfg->mqttPort3);
+  Serial.printf("  \"mqttTls\": %d,\n", cfg->mqttTls);
+  Serial.printf("  \"mqttFingerprint\": \"%s\",\n", cfg->mqttFingerprint);
+  Serial.printf("  \"mdnsDiscovery\": %d,\n", cfg->mdnsDiscovery);
+  Serial.printf("  \"wifiFastConnect\": %d,\n", cfg->wifiFastConnect);
+  Serial.printf("  \"wifiSleep\": %d\n", cfg->wifiSleep);
   Serial.println("}");
 }  
 
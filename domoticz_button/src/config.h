@@ -33,7 +33,56 @@
 #define MQTT_PORT 1883
 #define MQTT_USER ""
 #define MQTT_PSWD ""
-#define MQTT_BUFFER_SIZE 768;
+#define MQTT_BUFFER_SIZE 768
+
+// Backup MQTT brokers, tried in order when the broker above cannot be reached.
+// The button returns to the first broker once it is reachable again. Leave 
+// the host empty if there is no backup broker.
+#define MQTT_HOST2 ""
+#define MQTT_PORT2 1883
+#define MQTT_HOST3 ""
+#define MQTT_PORT3 1883
+
+// When MQTT_TLS is 1, the connection to the MQTT brokers is encrypted with TLS,
+// usually on port 8883. The certificate of the broker is checked against 
+// MQTT_FINGERPRINT, the SHA-1 fingerprint of the certificate ("AB:CD:..." as 
+// shown by openssl x509 -fingerprint). If it is empty, the certificate is 
+// checked against the trust anchors in mqttca.h. If neither can be used, the 
+// button does not connect. When MQTT_TLS is 2, the connection is encrypted 
+// but the certificate is not checked at all. The receive and transmit TLS buffers are reduced to 
+// MQTT_TLS_MFLN bytes with brokers that support the maximum fragment length 
+// extension.
+#define MQTT_TLS 0  // 0 plain TCP, 1 TLS, 2 TLS without checking the certificate
+#define MQTT_FINGERPRINT ""
+#define MQTT_TLS_MFLN 1024
+
+// When MQTT_STREAMING is 1, the payload of received messages is scanned as it is 
+// read from the network so that messages longer than MQTT_BUFFER_SIZE are not dropped. 
+// The buffer must still hold the topic of received messages and the messages sent
+// to the broker, 256 bytes is plenty for that.
+#define MQTT_STREAMING 0  // 0 messages decoded in the MQTT buffer, 1 streamed
+
+// When MQTT_PERSISTENT is 1, the button connects to the broker with a persistent session
+// and subscribes at QoS 1 so that the broker queues the Domoticz messages published
+// while the button is disconnected. The status of all devices is only requested again 
+// if the session has expired.
+#define MQTT_PERSISTENT 0  // 0 clean session and QoS 0, 1 persistent session and QoS 1
+
+// Maximum number of device status requests sent to Domoticz and not yet answered
+// when synchronizing after connecting to the MQTT broker. 
+#define MQTT_SYNC_WINDOW 4
+
+// *** Domoticz HTTP server ***
+//
+// When DOMO_BOOTSTRAP is 1, the status of all devices is obtained with two requests
+// to the Domoticz JSON API at http:// + config.domoHost + ":" + config.domoPort
+// once at boot, before the first connection to the MQTT broker. Only the devices
+// not found are then requested over MQTT. Later reconnections to the broker 
+// use MQTT only.
+
+#define DOMO_HOST "192.168.1.11"
+#define DOMO_PORT 8080
+#define DOMO_BOOTSTRAP 0  // 0 status requested over MQTT, 1 from the HTTP JSON API
 
 // *** OTA server ***
 //
@@ -47,18 +96,51 @@
 #define OTA_URL_BASE  "/domoticz_button/"  // include trailing separator
 #define OTA_AUTO_FIRMWARE_UPDATE  0 // false, 1 true
 
+// *** Wi-Fi ***
+
+// When WIFI_FAST_CONNECT is 1, the button reconnects to the same access point on 
+// the same channel after a restart, without scanning the Wi-Fi channels. When it
+// is 2, it also reuses its previous IP address, gateway and DNS server instead 
+// of waiting for DHCP. This data is kept in RTC memory, so the first connection
+// after a power on always uses WiFiManager.
+#define WIFI_FAST_CONNECT 1  // 0 WiFiManager only, 1 same access point, 2 same access point and IP
+
+// When WIFI_SLEEP is not 0, the Wi-Fi radio is kept awake while the display is on
+// and only allowed to sleep while it is blanked, in modem sleep (1) or light sleep (2). 
+// Any input wakes the radio before it is handled. When it is 0, the default modem 
+// sleep of the ESP8266 is used at all times.
+#define WIFI_SLEEP 1  // 0 SDK default, 1 modem sleep when blanked, 2 light sleep when blanked
+
+// *** Discovery of the servers ***
+
+// When MDNS_DISCOVERY is 1, the MQTT broker, the syslog server and the OTA server
+// are looked up with mDNS/DNS-SD (_mqtt._tcp, _syslog._udp and _http._tcp with a
+// "ota" TXT record) after a power on. The addresses found replace MQTT_HOST, 
+// SYSLOG_HOST and OTA_HOST and their ports in the saved configuration. They are 
+// kept in RTC memory so that restarts do not wait for the answers, and a server 
+// is only looked up again when the connection to it fails.
+#define MDNS_DISCOVERY 0  // 0 configured addresses, 1 discovery
+
 // *** Default device
 
 #define DEFAULT_DEVICE  65535 // for none usee some big number < 65536 that is greater than number of devices
 #define DEFAULT_ACTIVE      0 // false; 1 true
 
+// *** Live dimming ***
+
+// Maximum number of dim level commands sent per second while the rotary encoder is 
+// turned when setting the level of a dimmer. If 0, the level is only sent when the 
+// push button is clicked.
+#define LIVE_DIM_RATE  0
+
 // *** Time delays (in seconds) ***
 
 #define DISPLAY_TIMEOUT      15  // period of inactivity before blanking display (seconds)
 #define ALERT_TIME            3  // alert on/off time (seconds)
-#define MQTT_UPDATE_TIME      5  // initial updating time after MQTT subscribe in mqttReconnect() (seconds)
+#define MQTT_UPDATE_TIME      5  // maximum time to get the status of all devices after connecting to the MQTT broker (seconds)
 #define INFO_TIME             3  // minimum time displaying statup info messages (seconds)
 #define SUSPEND_BUZZER_TIME  60  // suspension time when sound alert suspended (minutes)
+#define MQTT_CMD_EXPIRY      30  // maximum age of a command queued while not connected to the MQTT broker, 0 to not queue (seconds)
 
 // *** Log levels ***
 
@@ -70,6 +152,19 @@
 #define DOMO_SUB_TOPIC "domoticz/in"   // case sensitive
 #define DOMO_PUB_TOPIC "domoticz/out"  // case sensitive
 
+// Per device topic on which Domoticz publishes status messages, ${idx} is replaced
+// with the Domoticz idx of the device. When MQTT_SUBSCRIBE_MODE is 1, the button 
+// subscribes to these topics instead of DOMO_PUB_TOPIC so that the broker does not 
+// send it messages for other devices. If nothing is received on these topics, 
+// the button falls back to DOMO_PUB_TOPIC.
+#define DOMO_IDX_TOPIC "domoticz/out/${idx}"  // case sensitive
+#define MQTT_SUBSCRIBE_MODE  0  // 0 DOMO_PUB_TOPIC only, 1 per device topics with fallback
+
+// Root of the compact state topics <DOMO_STATE_TOPIC>/device/<idx> and <DOMO_STATE_TOPIC>/scene/<idx>
+// on which the current state of devices is published with the retain flag by a Domoticz
+// event script. Leave empty if these topics are not published.
+#define DOMO_STATE_TOPIC ""  // case sensitive, for example "domoticz/state"
+
 // *** String buffer lengths
 
 // Maximum number of characters in string including terminating 0
@@ -80,7 +175,8 @@
 #define PSWD_SZ            65  // minimum 8
 #define HOST_NAME_SZ       32  // maximum size of 31 bytes for OpenSSL e-mail certificates
 #define MSG_SZ            441  // needs to be big enough for "reach" command (i.e. > 3*URL_SZ)
-#define TOPIC_SZ       PWD_SZ
+#define TOPIC_SZ      PSWD_SZ
+#define FINGERPRINT_SZ     60  // 20 hex bytes separated by ':'
 
 #define CONFIG_MAGIC    0x4D44    // 'M'+'D'
 
@@ -91,7 +187,7 @@ struct config_t {
   uint16_t mqttPort;              // MQTT port
   char mqttUser[SSID_SZ];         // *** NOT YET IMPLEMENTED ***
   char mqttPswd[PSWD_SZ];         // *** NOT YET IMPLEMENTED ***
-  uint16_t mqttBufferSize;        // In case Domoticz moves to longer MQTT messages
+  uint16_t mqttBufferSize;        // Largest received message when not streaming, largest sent message
   char syslogHost[URL_SZ];        // URL of Syslog server
   uint16_t syslogPort;            // Syslog port
   char otaHost[URL_SZ];           // URL of HTTP server with the firmware and configuration files
@@ -103,10 +199,30 @@ struct config_t {
   uint32_t displayTimeout;        // Inactivity delay before blanking the display (seconds)
   uint32_t alertTime;             // On and Off times when flashing an alert (seconds)
   uint32_t infoTime;              // Time to display information screens on restart
-  uint32_t mqttUpdateTime;        // Delay after requesting device status from Domoticz on startup
+  uint32_t mqttUpdateTime;        // Maximum time to get the status of all devices from Domoticz on connecting
   uint32_t suspendBuzzerTime;     // Time of sound alert suspensions
   uint8_t logLevelUart;           // Level of log messages shown on the serial port
   uint8_t logLevelSyslog;         // Level of log messages sent to the syslog sever
+  uint8_t mqttSubscribeMode;      // 0 subscribe to DOMO_PUB_TOPIC, 1 subscribe to per device topics
+  char mqttIdxTopic[TOPIC_SZ];    // per device Domoticz topic, ${idx} replaced with device idx
+  uint8_t mqttStreaming;          // 1 scan received messages as they are read, 0 decode them in the MQTT buffer
+  uint8_t mqttSyncWindow;         // Maximum number of outstanding device status requests 
+  char domoHost[URL_SZ];          // URL of Domoticz HTTP server
+  uint16_t domoPort;              // Domoticz HTTP port
+  uint8_t domoBootstrap;          // 1 get the status of devices from the Domoticz HTTP JSON API on connecting
+  char mqttStateTopic[TOPIC_SZ];  // root of retained compact state topics, empty if not used
+  uint8_t mqttPersistent;         // 1 persistent MQTT session with QoS 1 subscriptions
+  uint32_t mqttCmdExpiry;         // Maximum age of a queued command when the MQTT connection is restored
+  uint8_t liveDimRate;            // Maximum dim level commands per second while dimming, 0 to send on click only 
+  char mqttHost2[URL_SZ];         // URL of first backup MQTT server, empty if none
+  uint16_t mqttPort2;             // MQTT port of first backup server
+  char mqttHost3[URL_SZ];         // URL of second backup MQTT server, empty if none
+  uint16_t mqttPort3;             // MQTT port of second backup server
+  uint8_t mqttTls;                // 1 TLS connection to the MQTT brokers, 2 without checking their certificate
+  char mqttFingerprint[FINGERPRINT_SZ]; // SHA-1 fingerprint of the broker certificate, empty to use the trust anchors
+  uint8_t mdnsDiscovery;          // 1 look up the MQTT, syslog and OTA servers with mDNS
+  uint8_t wifiFastConnect;        // 1 reconnect to the same access point after a restart, 2 also reuse the IP address
+  uint8_t wifiSleep;              // 0 SDK default, 1 modem sleep when blanked, 2 light sleep when blanked
   uint32_t checksum;              // Used to validate saved configuration
 };
 
@@ -119,13 +235,13 @@ loadConfig_t loadConfig(void);
 void useDefaultConfig(void);
 bool updateConfig(void);
 void clearEEPROM(void);  // default config will be used on next boot
+void saveConfigToEEPROM(void);
 
 #ifdef DEBUG_CONFIG
   uint32_t getConfigHash();
   uint32_t loadConfigFromEEPROM(void);
   void useDefaultConfig(void);
   void clearConfig(config_t* cfg);
-  void saveConfigToEEPROM(void);
 
   void dumpConfigJson(config_t * cfg, char * msg);
   void dumpConfig(config_t* cfg, char* msg = NULL);
@@ -27,8 +27,8 @@ const char * devicestatus[] = {
 };
 
 
-// only used in logging messages - not translated
-const char * devicetypes[] = {"switch", "dimmer", "push off", "contact", "selector", "group", "scene"};
+// only used in logging messages - not translated, in the order of devtype_t
+const char * devicetypes[] = {"switch", "dimmer", "contact", "selector", "group", "push off", "scene", "macro"};
 
 // Everything in a device_t struct is constant except for on and nvalue which are
 // automatically updated from MQTT messages published by domoticz to the 
@@ -69,7 +69,7 @@ device_t devices[] {
   /* 14 */   {DS_OFF,   0,   7, DT_SWITCH,   Z_GARAGE, "Garage intérieur"},
   /* 15 */   {DS_NO,    0,  37, DT_SELECTOR, Z_GARAGE, "Fermeture auto."},
   /* 16 */   {DS_OPEN,  0,  29, DT_CONTACT,  Z_GARAGE, "Porte"},
-  /* 17 */   {DS_NONE,  0,  28, DT_PUSH_OFF, Z_GARAGE, "Fermer porte"},
+  /* 17 */   {DS_NONE,  0,  28, DT_PUSH_OFF, Z_GARAGE, "Fermer porte", DF_PUBLISH_OUT},
     
   /* 18 */   {DS_OFF,   0, 138, DT_SWITCH,   Z_BASEMENT, "Marches sous-sol"},
   /* 19 */   {DS_OFF,   0,  72, DT_SWITCH,   Z_BASEMENT, "Lampe sofa"},
@@ -78,12 +78,62 @@ device_t devices[] {
   /* 22 */   {DS_OFF,   0, 173, DT_SWITCH,   Z_BASEMENT, "Torchère"},
   /* 23 */   {DS_NONE,  0,   6, DT_GROUP,    Z_BASEMENT, "Sous-sol"},
 
-  /* 24 */   {DS_DEFAULT,  0,   159, DT_SELECTOR, Z_HOUSE, "Calendrier"}
+  /* 24 */   {DS_DEFAULT,  0,   159, DT_SELECTOR, Z_HOUSE, "Calendrier"},
+  /* 25 */   {DS_OFF,   0,   1, DT_MACRO,    Z_HOUSE, "Rez-de-chaussée"}
 };
 
 const uint16_t deviceCount = sizeof(devices)/sizeof(device_t);
 
+// Perfect hash of the (type, idx) keys of the devices[] array
+//
+// The table sizes are compile time constants derived from deviceCount. The
+// content is built by initDevices() with the "hash and displace" method. 
+// Keys are first distributed in buckets, then a displacement is found for 
+// each bucket, biggest buckets first, such that all of its keys land in 
+// free slots of the table. A lookup is two hashes, two table reads and one 
+// key comparison whatever the number of devices.
+
+static constexpr uint16_t nextPow2(uint16_t n, uint16_t p = 1) {
+  return (p >= n) ? p : nextPow2(n, 2*p);
+}
+
+#define HASH_SLOTS    nextPow2(deviceCount + deviceCount/4 + 1)  // load factor <= 0.8 
+#define HASH_BUCKETS  nextPow2(deviceCount/2 + 1)                // about 2 keys per bucket 
+#define HASH_MAX_SEED 64
+
+static int16_t hashSlots[HASH_SLOTS];     // index in devices[] or -1 for an empty slot
+static uint8_t hashDisp[HASH_BUCKETS];    // displacement of each bucket
+static uint32_t hashSeed;
+static bool hashValid = false;            // use a linear search if no perfect hash was found
+
+static inline uint32_t deviceKey(devtype_t type, uint32_t idx) {
+  return (idx << 3) | type;
+}
+
+static inline uint32_t mixKey(uint32_t k, uint32_t seed) {
+  k ^= seed;
+  k ^= k >> 16;
+  k *= 0x85ebca6b;
+  k ^= k >> 13;
+  k *= 0xc2b2ae35;
+  k ^= k >> 16;
+  return k;
+}
+
+static inline uint16_t hashBucket(uint32_t key) {
+  return mixKey(key, hashSeed) & (HASH_BUCKETS-1);
+}
+
+static inline uint16_t hashSlot(uint32_t key, uint8_t disp) {
+  return mixKey(key, hashSeed ^ ((disp + 1) * 0x9E3779B9u)) & (HASH_SLOTS-1);
+}
+
 int findDevice(devtype_t type, uint32_t idx) {
+  if (hashValid) {
+    uint32_t key = deviceKey(type, idx);
+    int n = hashSlots[hashSlot(key, hashDisp[hashBucket(key)])];
+    return (n >= 0 && devices[n].type == type && devices[n].idx == idx) ? n : -1;
+  }
   for (int n = 0; n < deviceCount; n++) {
     if (devices[n].type == type && devices[n].idx == idx) 
       return n;
@@ -91,6 +141,132 @@ int findDevice(devtype_t type, uint32_t idx) {
   return -1;
 }
 
+// true if devices[n] has the same key as a previous device in the table,
+// findDevice() will return the index of the first one 
+static bool isDuplicate(int n) {
+  for (int k = 0; k < n; k++) {
+    if (devices[k].type == devices[n].type && devices[k].idx == devices[n].idx)
+      return true;
+  }
+  return false;
+}
+
+// Tries to place the count keys of the devices listed in keys[] with the current 
+// hashSeed. The work arrays order[] and start[] must be able to hold count and 
+// HASH_BUCKETS+1 entries respectively. Returns false on failure.
+static bool buildHash(const uint16_t* keys, uint16_t count, uint16_t* order, uint16_t* start) {
+  uint16_t maxSize = 0;
+
+  // counting sort of the devices by bucket 
+  memset(start, 0, (HASH_BUCKETS+1)*sizeof(uint16_t));
+  for (uint16_t k = 0; k < count; k++) 
+    start[hashBucket(deviceKey(devices[keys[k]].type, devices[keys[k]].idx)) + 1]++;
+  for (uint16_t b = 0; b < HASH_BUCKETS; b++) {
+    if (start[b+1] > maxSize) maxSize = start[b+1];
+    start[b+1] += start[b];
+  }
+  for (uint16_t k = 0; k < count; k++) {
+    uint16_t b = hashBucket(deviceKey(devices[keys[k]].type, devices[keys[k]].idx));
+    uint16_t pos = start[b];
+    while (order[pos] != 0xFFFF) pos++;  // order[] is cleared by the caller
+    order[pos] = keys[k];
+  }
+
+  memset(hashSlots, 0xFF, sizeof(hashSlots));
+  memset(hashDisp, 0, sizeof(hashDisp));
+
+  // place the biggest buckets first
+  for (uint16_t size = maxSize; size > 0; size--) {
+    for (uint16_t b = 0; b < HASH_BUCKETS; b++) {
+      if (start[b+1] - start[b] != size) continue;
+      bool placed = false;
+      for (uint16_t d = 0; d < 256 && !placed; d++) {
+        uint16_t k;
+        for (k = start[b]; k < start[b+1]; k++) {
+          int n = order[k];
+          uint16_t slot = hashSlot(deviceKey(devices[n].type, devices[n].idx), d);
+          if (hashSlots[slot] >= 0) break;
+          hashSlots[slot] = n;
+        }
+        placed = (k == start[b+1]);
+        if (placed) {
+          hashDisp[b] = d;
+        } else {
+          // undo the partial placement of bucket b
+          while (k-- > start[b]) {
+            int n = order[k];
+            hashSlots[hashSlot(deviceKey(devices[n].type, devices[n].idx), d)] = -1;
+          }  
+        }
+      }
+      if (!placed) return false;
+    }
+  }
+  return true;
+}
+
+// Ignores the members of macros[i] that are not in devices[] or that are
+// macros themselves, and the whole macro if its own index is not a macro
+static void checkMacro(int i) {
+  macro_t& macro = macros[i];
+  if (macro.index >= deviceCount || devices[macro.index].type != DT_MACRO) {
+    sendToLogPf(LOG_ERR, PSTR("Macro %d: device %d is not a macro, macro ignored"), i, macro.index);
+    macro.count = 0;
+    return;
+  }
+  uint16_t max = sizeof(macro.members)/sizeof(macro.members[0]);
+  if (macro.count > max) {
+    sendToLogPf(LOG_ERR, PSTR("Macro %s has %d members, only the first %d are used"), devices[macro.index].name, macro.count, max);
+    macro.count = max;
+  }
+  uint16_t kept = 0;
+  for (uint16_t k = 0; k < macro.count; k++) {
+    uint16_t member = macro.members[k];
+    if (member >= deviceCount || devices[member].type == DT_MACRO)
+      sendToLogPf(LOG_ERR, PSTR("Macro %s: member %d is %s, ignored"), devices[macro.index].name, member, 
+        (member >= deviceCount) ? "not a device" : "a macro");
+    else
+      macro.members[kept++] = member;
+  }
+  macro.count = kept;
+}
+
+void initDevices(void) {
+  uint16_t count = 0;
+  uint16_t* keys = (uint16_t*) malloc(2*deviceCount*sizeof(uint16_t) + (HASH_BUCKETS+1)*sizeof(uint16_t));
+
+  for (int n = 0; n < deviceCount; n++) {
+    devices[n].selector = -1;
+    if (isDuplicate(n))
+      sendToLogPf(LOG_ERR, PSTR("Device %d (%s) is a duplicate of an earlier %s with idx %d"), n, devices[n].name, devicetypes[devices[n].type], devices[n].idx);
+    else if (keys)
+      keys[count++] = n;
+  }
+  for (int i = 0; i < selectorCount; i++) {
+    if (selectors[i].index < deviceCount) 
+      devices[selectors[i].index].selector = i;
+  }
+  for (int i = 0; i < macroCount; i++)
+    checkMacro(i);
+
+  hashValid = false;
+  if (keys) {
+    uint16_t* order = keys + deviceCount;
+    uint16_t* start = order + deviceCount;
+    hashSeed = 0;
+    while (!hashValid && hashSeed < HASH_MAX_SEED) {
+      memset(order, 0xFF, deviceCount*sizeof(uint16_t));
+      hashValid = buildHash(keys, count, order, start);
+      if (!hashValid) hashSeed++;
+    }
+    free(keys);
+  }
+  if (hashValid) 
+    sendToLogPf(LOG_DEBUG, PSTR("Device hash of %d keys in %d slots, %d buckets, seed %d"), count, HASH_SLOTS, HASH_BUCKETS, hashSeed);
+  else
+    sendToLogP(LOG_ERR, PSTR("Could not build the device hash table, using linear search"));
+}
+
 #ifdef BALLISTIC_ROTATION
 int nextZone(int cdev) {
   zone_t currentZone = devices[cdev].zone;
@@ -136,10 +312,7 @@ selector_t selectors[] {
 const uint16_t selectorCount = sizeof(selectors)/sizeof(selector_t);
 
 int findSelector(int index) {
-  for (int i=0; i<selectorCount; i++) {
-    if (selectors[i].index == index) return i;
-  }
-  return -1;
+  return (index >= 0 && index < deviceCount) ? devices[index].selector : -1;
 }
 
 
@@ -151,6 +324,22 @@ group_t groups[] {
 
 const uint16_t groupCount = sizeof(groups)/sizeof(group_t);
 
+
+// Macros. Currently one macro in the table
+macro_t macros[] {
+    {25, 3, {6, 7, 8}}    // Lampes rez-de-chaussée {Lampe sur pied, Lampe sur table, Bibliothèques}
+};
+
+const uint16_t macroCount = sizeof(macros)/sizeof(macro_t);
+
+int findMacro(int index) {
+  for (int i = 0; i < macroCount; i++) {
+    if (macros[i].index == index)
+      return i;
+  }
+  return -1;
+}
+
 // Alerts. Currently two alerts are set up
 alert_t alerts[] {
   {16, DS_OPEN, 1},  // garage door : alert when open (DS_OPEN), sound alert
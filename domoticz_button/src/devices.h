@@ -13,9 +13,13 @@ enum devtype_t {
    DT_SELECTOR, // status is value of selection};    
    DT_GROUP,    // status is On, Off or mixed depending on status of members
    DT_PUSH_OFF, // no status
-   DT_SCENE     // no status
+   DT_SCENE,    // no status
+   DT_MACRO     // local to the button, status is On, Off or mixed depending on status of members
 };
 
+// number of device types
+#define DT_COUNT (DT_MACRO + 1)
+
 // name of each device type - used for logging only
 extern const char* devicetypes[];
 
@@ -44,6 +48,13 @@ enum devstatus_t {
 extern const char* devicestatus[]; 
 
 
+// Device flags
+
+// Instead of sending a command to Domoticz, the button publishes the new status 
+// of the device on DOMO_PUB_TOPIC as if it came from Domoticz. Use for push 
+// off buttons for which Domoticz does not publish a status message. 
+#define DF_PUBLISH_OUT  0x01
+
 // Structure used to represent each Domoticz virtual device
 //
 typedef struct {
@@ -54,8 +65,22 @@ typedef struct {
   const zone_t zone;    // zone in house where device is found
   const char* name;     // name of the device, can be different from that used in 
                         // domoticz but that would be confusing 
+  const uint8_t flags;  // DF_xxx flags, can be omitted if 0 
+  int16_t selector;     // index in selectors[] of a selector switch, -1 for other 
+                        // devices. Set by initDevices(), do not initialize
+  uint8_t sync;         // syncstate_t of the device, do not initialize
 } device_t;
 
+// Progress of the request of the status of a device from Domoticz after 
+// connecting to the MQTT broker
+enum syncstate_t {
+  SS_NONE,       // not requested, device without status or sync not started 
+  SS_NEEDED,     // status to be requested
+  SS_STALE,      // status restored after a restart or request timed out, to be requested after the SS_NEEDED devices
+  SS_REQUESTED,  // status requested, no answer yet
+  SS_CONFIRMED   // status received from Domoticz
+};
+
 extern device_t devices[];
 extern const uint16_t deviceCount; 
 
@@ -63,8 +88,14 @@ extern const uint16_t deviceCount;
 // the given Domoticz idx and the give device type as search criteria.
 // The Domoticz idx is unique only for a given type of device,
 // so there can be an On/Off switch with idx 6 and a scene with idx 6.
+// Returns -1 if the device is not in the array.
 int findDevice(devtype_t type, uint32_t idx);
 
+// Builds the perfect hash table used by findDevice() and sets the selector
+// field of each device. Must be called once in setup() before any device 
+// is looked up.
+void initDevices(void);
+
 #ifdef BALLISTIC_ROTATION
 extern int nextZone(int cdev);
 extern int prevZone(int cdev);
@@ -79,10 +110,11 @@ typedef struct {
 } selector_t;
 
 extern selector_t selectors[];
-extern const uint16_t seclectorCount;
+extern const uint16_t selectorCount;
 
 // find the index of a selector in the selectors[] array using the
-// index in the devices[] array as search criterion.
+// index in the devices[] array as search criterion. Returns -1
+// if the device is not a selector.
 int findSelector(int index);
 
 // Groups
@@ -103,6 +135,28 @@ typedef struct {
 extern group_t groups[];
 extern const uint16_t groupCount; 
 
+// Macros
+//
+// A macro is a device that does not exist in Domoticz. Clicking it sends the 
+// same On or Off command to each of its members, which can be switches, 
+// dimmers or groups. Its status is computed from the status of its members
+// in the same way as the status of a group. The idx of a macro in devices[]
+// is not used except that it must be different from that of other macros.
+
+typedef struct {
+  uint16_t index;       // device index of macro 
+  uint16_t count;       // number of members in the macro (max 8)
+  uint16_t members[8];  // list of devices index of members of the macro
+} macro_t;
+
+extern macro_t macros[];
+extern const uint16_t macroCount; 
+
+// find the index of a macro in the macros[] array using the index
+// in the devices[] array as search criterion. Returns -1 if the 
+// device is not a macro.
+int findMacro(int index);
+
 // Alerts
 //
 
@@ -0,0 +1,129 @@
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESP8266mDNS.h>
+#include "config.h"
+#include "logging.h"
+#include "rtcmem.h"
+#include "mqtttls.h"
+#include "discovery.h"
+
+#define MDNS_OTA_TXT "ota"  // TXT record key identifying the OTA server among the HTTP servers
+
+typedef struct {
+  const char* service;
+  const char* protocol;
+  const char* txt;  // TXT record key the service must have, NULL if any instance will do
+  char* host;
+  uint16_t* port;
+} serviceDef_t;
+
+static const serviceDef_t services[SRV_COUNT] = {
+  {"mqtt", "tcp", NULL, config.mqttHost, &config.mqttPort},
+  {"syslog", "udp", NULL, config.syslogHost, &config.syslogPort},
+  {"http", "tcp", MDNS_OTA_TXT, config.otaHost, &config.otaPort}
+};
+
+/* * * Answers in RTC memory * * */
+
+typedef struct {
+  uint32_t address[SRV_COUNT];  // 0 if the service was not found 
+  uint16_t port[SRV_COUNT];
+} rtcDiscovery_t;
+
+static_assert((sizeof(rtcDiscovery_t) + 8 + 3)/4 <= RTC_DISCOVERY_BLOCKS, "RTC_DISCOVERY_BLOCKS too small");
+
+static rtcDiscovery_t found;
+static uint32_t lastBrowse[SRV_COUNT];
+
+/* * * Discovery * * */
+
+// true if one of the items of the TXT record, "key=value" strings separated 
+// by ';', is key with or without a value
+static bool hasTxtKey(const char* txts, const char* key) {
+  size_t len = strlen(key);
+  for (const char* item = txts; item; item = strchr(item, ';')) {
+    if (*item == ';')
+      item++;
+    if (!strncmp(item, key, len) && (item[len] == '\0' || item[len] == ';' || item[len] == '='))
+      return true;
+  }
+  return false;
+}
+
+// Browses service n and saves the first answer in found. A service that is
+// not found keeps its previous answer, if any.
+static bool browse(service_t n) {
+  const serviceDef_t& srv = services[n];
+  uint32_t start = millis();
+  uint32_t count = MDNS.queryService(srv.service, srv.protocol, MDNS_BROWSE_TIME);
+  bool result = false;
+  for (uint32_t i = 0; i < count; i++) {
+    if (srv.txt && !(MDNS.hasAnswerTxts(i) && hasTxtKey(MDNS.answerTxts(i), srv.txt)))
+      continue;
+    found.address[n] = MDNS.answerIP(i);
+    found.port[n] = MDNS.answerPort(i);
+    sendToLogPf(LOG_INFO, PSTR("mDNS: _%s._%s found on %s (%s:%u) in %u ms"), srv.service, srv.protocol, 
+      MDNS.answerHostname(i), IPAddress(found.address[n]).toString().c_str(), found.port[n], (unsigned) (millis() - start));
+    result = true;
+    break;
+  }
+  MDNS.removeQuery();
+  lastBrowse[n] = millis();
+  if (!result) 
+    sendToLogPf(LOG_ERR, PSTR("mDNS: _%s._%s not found in %u ms (%u answers)"), srv.service, srv.protocol, (unsigned) (millis() - start), (unsigned) count);
+  return result;
+}
+
+// Copies the address and port found for service n into the configuration. Returns
+// true if they are different.
+static bool apply(service_t n) {
+  if (!found.address[n])
+    return false;
+  const serviceDef_t& srv = services[n];
+  // the TLS certificate check needs the configured host name
+  bool keepHost = (n == SRV_MQTT && mqttTlsNeedsHostName());
+  String host = IPAddress(found.address[n]).toString();
+  if ((keepHost || !strcmp(srv.host, host.c_str())) && *srv.port == found.port[n])
+    return false;
+  if (!keepHost)
+    strlcpy(srv.host, host.c_str(), URL_SZ);
+  *srv.port = found.port[n];
+  return true;
+}
+
+void discoverServers(void) {
+  if (!config.mdnsDiscovery)
+    return;
+  if (rtcRead(RTC_DISCOVERY_BLOCK, RTC_DISCOVERY_MAGIC, &found, sizeof(found))) {
+    // restart, the servers have not moved
+    for (int n = 0; n < SRV_COUNT; n++)
+      apply((service_t) n);  
+    sendToLogP(LOG_INFO, PSTR("mDNS: using the servers found before the restart"));
+    return;
+  }
+  uint32_t start = millis();
+  bool changed = false;
+  MDNS.begin(config.hostname);
+  for (int n = 0; n < SRV_COUNT; n++) {
+    if (browse((service_t) n))
+      changed |= apply((service_t) n);
+  }
+  MDNS.end();
+  rtcWrite(RTC_DISCOVERY_BLOCK, RTC_DISCOVERY_BLOCKS, RTC_DISCOVERY_MAGIC, &found, sizeof(found));
+  if (changed)
+    saveConfigToEEPROM();
+  sendToLogPf(LOG_INFO, PSTR("mDNS: discovery done in %u ms"), (unsigned) (millis() - start));
+}
+
+bool rediscoverServer(service_t service) {
+  if (!config.mdnsDiscovery || (lastBrowse[service] && millis() - lastBrowse[service] < MDNS_REBROWSE_INTERVAL))
+    return false;
+  MDNS.begin(config.hostname);
+  bool changed = browse(service) && apply(service);
+  MDNS.end();
+  if (changed) {
+    rtcWrite(RTC_DISCOVERY_BLOCK, RTC_DISCOVERY_BLOCKS, RTC_DISCOVERY_MAGIC, &found, sizeof(found));
+    saveConfigToEEPROM();
+  }
+  return changed;
+}
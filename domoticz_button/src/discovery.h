@@ -0,0 +1,41 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <Arduino.h>
+
+/*
+ * Discovery of the servers with mDNS/DNS-SD
+ *
+ * When config.mdnsDiscovery is set, the MQTT broker (_mqtt._tcp), the 
+ * syslog server (_syslog._udp) and the OTA server (_http._tcp with an 
+ * "ota" TXT record) are browsed after a power on. The address and port 
+ * found replace the host and port of the server in the configuration, 
+ * which is saved if it changed, so that the last known servers are used 
+ * if nothing answers. When the certificate of the MQTT broker is checked 
+ * against the trust anchors, which needs its host name, only the port of 
+ * the broker is taken from the answer. The answers are also kept in the RTC user memory: 
+ * after a restart they are used without browsing, and a server is only 
+ * browsed again when connecting to it fails.
+ */
+
+enum service_t {
+  SRV_MQTT,
+  SRV_SYSLOG,
+  SRV_OTA,
+  SRV_COUNT
+};
+
+#define MDNS_BROWSE_TIME      1000  // ms, time waiting for answers
+#define MDNS_REBROWSE_INTERVAL 60000  // ms, minimum time between two lookups of the same service
+
+// Browses all services after a power on, or uses the answers saved in the 
+// RTC memory after a restart. To be called in setup() once connected to Wi-Fi.
+void discoverServers(void);
+
+// Browses the service again after a failed connection to the server. Returns
+// true if a different address or port was found and the configuration updated.
+// Blocks for MDNS_BROWSE_TIME, so it must not be called while the button is 
+// in use.
+bool rediscoverServer(service_t service);
+
+#endif
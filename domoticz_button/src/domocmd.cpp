@@ -0,0 +1,81 @@
+#include <Arduino.h>
+#include "config.h"
+#include "devices.h"
+#include "domocmd.h"
+
+// Commands to domoticz/in, see https://www.domoticz.com/wiki/Domoticz_API/JSON_URL%27s
+//   {"command":"switchlight", "idx":IDX, "switchcmd":"On"} or "Off" for switches, push off buttons and dimmers
+//   {"command":"switchlight", "idx":IDX, "switchcmd":"Set Level", "level":VAL} for dimmers and selectors, VAL 0..100,  
+//       VAL = 0 turns a dimmer off without changing its dim level, VAL > 0 sets the dim level and turns the light on
+//   {"command":"switchscene", "idx":IDX, "switchcmd":"On"} or "Off", only On is possible for scenes
+// Status message to domoticz/out, for devices with the DF_PUBLISH_OUT flag
+//   { "idx" : IDX, "nvalue" : 0 }
+
+static const char switchPrefix[] PROGMEM = "{\"command\":\"switchlight\", \"idx\":";
+static const char scenePrefix[] PROGMEM  = "{\"command\":\"switchscene\", \"idx\":";
+static const char outPrefix[] PROGMEM    = "{ \"idx\" : ";
+static const char onSuffix[] PROGMEM     = ", \"switchcmd\":\"On\"}";
+static const char offSuffix[] PROGMEM    = ", \"switchcmd\":\"Off\"}";
+static const char levelInfix[] PROGMEM   = ", \"switchcmd\":\"Set Level\", \"level\":";
+static const char levelSuffix[] PROGMEM  = "}";
+static const char outSuffix[] PROGMEM    = ", \"nvalue\" : 0 }";
+
+// longest command: switchPrefix + 10 digit idx + levelInfix + 11 character level + levelSuffix
+static_assert(sizeof(switchPrefix) + 10 + sizeof(levelInfix) + 11 + sizeof(levelSuffix) <= CMD_SZ, "CMD_SZ too small");
+
+static char* putP(char* p, PGM_P s) {
+  size_t n = strlen_P(s);
+  memcpy_P(p, s, n);
+  return p + n;
+}
+
+static char* putUint(char* p, uint32_t value) {
+  char digits[10];
+  int n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (n) 
+    *p++ = digits[--n];
+  return p;
+}
+
+static char* putInt(char* p, int32_t value) {
+  if (value < 0) {
+    *p++ = '-';
+    return putUint(p, -(uint32_t) value);
+  }
+  return putUint(p, value);
+}
+
+size_t encodeCommand(char* buf, int dev, int32_t value, bool isLevel, const char** topic) {
+  devtype_t type = devices[dev].type;
+  char* p = buf;
+  *topic = DOMO_SUB_TOPIC;
+
+  if (devices[dev].flags & DF_PUBLISH_OUT) {
+    // status message sent directly to the device instead of a command to Domoticz
+    *topic = DOMO_PUB_TOPIC;
+    p = putP(p, outPrefix);
+    p = putUint(p, devices[dev].idx);
+    p = putP(p, outSuffix);
+  } else if (type == DT_SWITCH || type == DT_PUSH_OFF || (type == DT_DIMMER && !isLevel)) {
+    p = putP(p, switchPrefix);
+    p = putUint(p, devices[dev].idx);
+    p = putP(p, (value) ? onSuffix : offSuffix);
+  } else if (type == DT_DIMMER || type == DT_SELECTOR) {
+    p = putP(p, switchPrefix);
+    p = putUint(p, devices[dev].idx);
+    p = putP(p, levelInfix);
+    p = putInt(p, value);
+    p = putP(p, levelSuffix);
+  } else if ((type == DT_SCENE && value) || type == DT_GROUP) {
+    p = putP(p, scenePrefix);
+    p = putUint(p, devices[dev].idx);
+    p = putP(p, (value) ? onSuffix : offSuffix);
+  } else 
+    return 0;
+  *p = 0;
+  return p - buf;
+}
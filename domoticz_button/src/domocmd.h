@@ -0,0 +1,24 @@
+#ifndef DOMOCMD_H
+#define DOMOCMD_H
+
+#include <Arduino.h>
+
+/*
+ * Encoder of the MQTT commands sent to Domoticz
+ *
+ * The fixed parts of the JSON payloads are kept in flash and copied 
+ * into the buffer, only the idx and the level are converted to text.
+ * No printf style formatting is involved.
+ */
+
+// Size of a buffer that can hold any command
+#define CMD_SZ 96
+
+// Builds the command setting devices[dev] to value in buf which must hold 
+// CMD_SZ bytes and sets topic to the topic on which it must be published. 
+// If isLevel is true, value is a dimmer or selector level (0..100), otherwise
+// 0 means Off and anything else On. Returns the length of the command or 0 
+// if the device type cannot be set to value.
+size_t encodeCommand(char* buf, int dev, int32_t value, bool isLevel, const char** topic);
+
+#endif
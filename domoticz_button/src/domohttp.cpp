@@ -0,0 +1,105 @@
+#include <Arduino.h>
+#include <ESP8266HTTPClient.h>
+#include <WiFiClient.h>
+#include <ArduinoJson.h>
+#include "config.h"
+#include "logging.h"
+#include "devices.h"
+#include "domoscan.h"
+#include "domohttp.h"
+#include "resolver.h"
+
+static const char devicesQuery[] = "/json.htm?type=devices&filter=light&used=true";
+static const char scenesQuery[] = "/json.htm?type=scenes";
+
+// Domoticz returns many fields for each device, only these are kept 
+//   idx, SwitchType (devices), Type (scenes and groups), Level and Status
+// The HTTP API does not return the nvalue, it is deduced from Status.
+
+#define ELEMENT_FIELD_COUNT  5
+#define ELEMENT_DOC_SIZE     (JSON_OBJECT_SIZE(ELEMENT_FIELD_COUNT) + 128)  // strings are copied from the stream
+
+static StaticJsonDocument<JSON_OBJECT_SIZE(ELEMENT_FIELD_COUNT)> elementFilter;
+
+static void initElementFilter(void) {
+  elementFilter["idx"] = true;
+  elementFilter["SwitchType"] = true;
+  elementFilter["Type"] = true;
+  elementFilter["Level"] = true;
+  elementFilter["Status"] = true;
+}
+
+// Decodes the "result" array of the response one element at a time so 
+// that the size of the response does not matter
+static int parseResult(Stream& stream, bool scenes, domoStatusHandler_t handler) {
+  StaticJsonDocument<ELEMENT_DOC_SIZE> doc;
+  int count = 0;
+
+  if (!stream.find("\"result\"") || !stream.find("["))
+    return 0;  // no device or no scene defined
+  do {
+    DeserializationError err = deserializeJson(doc, stream, DeserializationOption::Filter(elementFilter));
+    if (err) {
+      sendToLogPf(LOG_ERR, PSTR("deserializeJson() failed : %s with Domoticz %s list"), err.c_str(), (scenes) ? "scene" : "device");
+      break;
+    }
+    const char* sIdx = doc["idx"];  // the HTTP API returns all idx as strings
+    const char* sType = doc[(scenes) ? "Type" : "SwitchType"];
+    uint32_t idx = (sIdx) ? strtoul(sIdx, NULL, 10) : 0;
+    int type = (sType) ? domoDeviceType(sType, strlen(sType)) : -1;
+    int i = (idx && type >= 0) ? findDevice((devtype_t) type, idx) : -1;
+    if (i < 0) 
+      continue;
+
+    domoFields_t fields;
+    const char* sStatus = doc["Status"];
+    if (!sStatus) 
+      sStatus = "";
+    fields.nvalue = (strcmp(sStatus, "Off") && strcmp(sStatus, "Closed")) ? 1 : 0;
+    fields.level = doc["Level"].as<int>();
+    fields.svalue1 = fields.level;  // selection level of selectors
+    strlcpy(fields.status, sStatus, sizeof(fields.status));
+    handler(i, fields);
+    count++;
+  } while (stream.findUntil(",", "]"));
+  return count;
+}
+
+static int fetchList(const char* query, bool scenes, domoStatusHandler_t handler) {
+  WiFiClient wifiClient;
+  HTTPClient httpClient;
+  int result = -1;
+
+  IPAddress domoIp;
+  if (resolveHost(config.domoHost, domoIp) != HOST_RESOLVED) {
+    sendToLogPf(LOG_ERR, PSTR("Address of Domoticz server %s not known yet"), config.domoHost);
+    return result;
+  }
+  String url = String("http://") + domoIp.toString() + ":" + config.domoPort + query;
+  httpClient.useHTTP10(true);  // no chunked transfer encoding so the response can be read as a stream
+  if (httpClient.begin(wifiClient, url)) {
+    int httpCode = httpClient.GET();
+    if (httpCode == HTTP_CODE_OK) {
+      result = parseResult(httpClient.getStream(), scenes, handler);
+    } else {
+      sendToLogPf(LOG_ERR, PSTR("Domoticz request %s failed. HTTP error %s (%d)"), url.c_str(), httpClient.errorToString(httpCode).c_str(), httpCode);
+    }
+    httpClient.end();
+  } else {
+    sendToLogPf(LOG_ERR, PSTR("Unable to connect to %s"), url.c_str());
+  }
+  return result;
+}
+
+int fetchDomoticzStatus(domoStatusHandler_t handler) {
+  initElementFilter();
+  unsigned long start = millis();
+  int devs = fetchList(devicesQuery, false, handler);
+  if (devs < 0) 
+    return -1;
+  int scenes = fetchList(scenesQuery, true, handler);
+  if (scenes < 0) 
+    return -1;
+  sendToLogPf(LOG_INFO, PSTR("Status of %d devices and %d groups obtained from Domoticz in %u ms"), devs, scenes, (unsigned) (millis() - start));
+  return devs + scenes;
+}
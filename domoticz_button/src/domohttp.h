@@ -0,0 +1,20 @@
+#ifndef DOMOHTTP_H
+#define DOMOHTTP_H
+
+#include <Arduino.h>
+#include "domoscan.h"
+
+// Bulk retrieval of the status of devices from the Domoticz HTTP JSON API
+
+// Called with the index in devices[] and the status fields of each 
+// device found in the lists returned by Domoticz
+typedef void (*domoStatusHandler_t)(int index, const domoFields_t& fields);
+
+// Requests the list of used light/switch devices and the list of scenes 
+// and groups from the Domoticz server at config.domoHost:config.domoPort. 
+// The responses are parsed as they are received, one element at a time, 
+// and handler is called for each element that matches a device in devices[].
+// Returns the number of devices found or -1 if a request failed.
+int fetchDomoticzStatus(domoStatusHandler_t handler);
+
+#endif
@@ -0,0 +1,391 @@
+#include <Arduino.h>
+#include "devices.h"
+#include "domoscan.h"
+
+// Domoticz switchType (or Type for scenes and groups) strings of the handled
+// device types. Each string is identified by its length and first character
+// so that a lookup costs one 16 bit comparison per entry and a single 
+// memcmp() on a match. 
+
+typedef struct {
+  const char* name;
+  uint8_t len;
+  devtype_t type;
+} domoType_t;
+
+static constexpr domoType_t domoTypes[] = {
+  {"On/Off",   6, DT_SWITCH},
+  {"Dimmer",   6, DT_DIMMER},
+  {"Contact",  7, DT_CONTACT},
+  {"Selector", 8, DT_SELECTOR},
+  {"Group",    5, DT_GROUP}
+};
+
+static constexpr size_t domoTypeCount = sizeof(domoTypes)/sizeof(domoType_t);
+
+static constexpr uint16_t typeKey(uint8_t len, char first) {
+  return (len << 8) | (uint8_t) first;
+}
+
+static constexpr size_t cstrlen(const char* s) {
+  return (*s) ? 1 + cstrlen(s+1) : 0;
+}
+
+// compile time verifications of the table: each len field must be correct 
+// and the (length, first character) key of each entry must be unique
+
+static constexpr bool lengthsOk(size_t n = 0) {
+  return (n >= domoTypeCount) || (cstrlen(domoTypes[n].name) == domoTypes[n].len && lengthsOk(n+1));
+}
+
+static constexpr bool keyUnique(size_t n, size_t k) {
+  return (k >= domoTypeCount) || 
+    (typeKey(domoTypes[n].len, domoTypes[n].name[0]) != typeKey(domoTypes[k].len, domoTypes[k].name[0]) && keyUnique(n, k+1));
+}
+
+static constexpr bool keysUnique(size_t n = 0) {
+  return (n >= domoTypeCount) || (keyUnique(n, n+1) && keysUnique(n+1));
+}
+
+static_assert(lengthsOk(), "wrong length in domoTypes[]");
+static_assert(keysUnique(), "two domoTypes[] entries with the same length and first character");
+
+int domoDeviceType(const char* s, size_t len) {
+  if (!len || len > 255) 
+    return -1;
+  uint16_t key = typeKey(len, s[0]);
+  for (size_t n = 0; n < domoTypeCount; n++) {
+    if (typeKey(domoTypes[n].len, domoTypes[n].name[0]) == key) 
+      return (memcmp(s, domoTypes[n].name, len)) ? -1 : domoTypes[n].type;
+  }
+  return -1;
+}
+
+static const char* skipWhite(const char* p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) 
+    p++;
+  return p;
+}
+
+// p points to the opening quote, returns a pointer just past the closing quote
+static const char* skipString(const char* p, const char* end) {
+  for (p++; p < end; p++) {
+    if (*p == '\\') 
+      p++;
+    else if (*p == '"') 
+      return p+1;
+  }
+  return end;
+}
+
+// Skips a string, number, literal, object or array. Returns a pointer to the 
+// character following the value which should be ',' or '}'.
+static const char* skipValue(const char* p, const char* end) {
+  int depth = 0;
+  while (p < end) {
+    switch (*p) {
+      case '"': 
+        p = skipString(p, end);
+        if (!depth) return p;
+        continue;
+      case '{': 
+      case '[': 
+        depth++; 
+        break;
+      case '}': 
+      case ']':
+        if (!depth) return p;
+        if (!--depth) return p+1;
+        break;
+      case ',':
+        if (!depth) return p;
+        break;
+    }
+    p++;
+  }
+  return end;
+}
+
+// Domoticz sends the idx of devices as a number and the idx of scenes
+// and groups as a string 
+static uint32_t parseIdx(const char* p, const char* end) {
+  uint32_t idx = 0;
+  if (p < end && *p == '"') 
+    p++;
+  while (p < end && *p >= '0' && *p <= '9') 
+    idx = idx*10 + (*p++ - '0');
+  return idx;
+}
+
+bool scanDomoMessage(const char* payload, unsigned int length, domoScan_t* scan) {
+  const char* end = payload + length;
+  const char* p = skipWhite(payload, end);
+  int switchType = -1;
+  int type = -1;
+  bool hasSwitchType = false;
+
+  scan->idx = 0;
+  scan->type = -1;
+  if (p >= end || *p != '{') 
+    return false;
+  p++;
+
+  while (p < end) {
+    p = skipWhite(p, end);
+    if (p >= end || *p != '"') 
+      break;  // '}' or invalid JSON
+    const char* key = p + 1;
+    p = skipString(p, end);
+    size_t keyLen = p - key - 1;
+    p = skipWhite(p, end);
+    if (p >= end || *p != ':') 
+      break;
+    const char* value = skipWhite(p + 1, end);
+    if (value >= end)
+      break;
+    p = skipValue(value, end);
+
+    if (keyLen == 3 && !memcmp(key, "idx", 3)) {
+      scan->idx = parseIdx(value, p);
+    } else if (*value == '"' && keyLen == 10 && !memcmp(key, "switchType", 10)) {
+      hasSwitchType = true;
+      switchType = domoDeviceType(value + 1, skipString(value, p) - value - 2);
+    } else if (*value == '"' && keyLen == 4 && !memcmp(key, "Type", 4)) {
+      type = domoDeviceType(value + 1, skipString(value, p) - value - 2);
+    }  
+    if (scan->idx && hasSwitchType) 
+      break;  // nothing else needed
+
+    p = skipWhite(p, end);
+    if (p < end && *p == ',') 
+      p++;
+  }
+  scan->type = (hasSwitchType) ? switchType : type;
+  return scan->idx && scan->type >= 0;
+}
+
+/* * * Compact state messages * * */
+
+// Parses an optionally signed decimal integer, p is moved past its last digit
+static bool parseInt(const char*& p, const char* end, int32_t* value) {
+  bool negative = (p < end && *p == '-');
+  if (negative) 
+    p++;
+  if (p >= end || *p < '0' || *p > '9') 
+    return false;
+  int32_t n = 0;
+  while (p < end && *p >= '0' && *p <= '9') 
+    n = n*10 + (*p++ - '0');
+  *value = (negative) ? -n : n;
+  return true;
+}
+
+bool scanStateMessage(const char* subtopic, const char* payload, unsigned int length, bool* scene, uint32_t* idx, domoFields_t* fields) {
+  const char* p;
+  if (!strncmp(subtopic, "device/", 7)) {
+    *scene = false;
+    p = subtopic + 7;
+  } else if (!strncmp(subtopic, "scene/", 6)) {
+    *scene = true;
+    p = subtopic + 6;
+  } else 
+    return false;
+  *idx = parseIdx(p, p + strlen(p));
+  memset(fields, 0, sizeof(domoFields_t));
+  if (!*idx || !length)
+    return false;  // an empty payload clears a retained message
+
+  if (*scene) {
+    size_t n = (length < sizeof(fields->status)) ? length : sizeof(fields->status) - 1;
+    memcpy(fields->status, payload, n);
+    fields->status[n] = 0;
+    return true;
+  }  
+  const char* end = payload + length;
+  p = payload;
+  if (!parseInt(p, end, &fields->nvalue)) 
+    return false;
+  if (p < end && *p == ',') {
+    p++;
+    if (!parseInt(p, end, &fields->level))
+      return false;
+    fields->svalue1 = fields->level;
+  }
+  return true;
+}
+
+/* * * DomoStream * * */
+
+enum {
+  ST_START,      // before the opening '{'
+  ST_KEY_WAIT,   // before a key or the closing '}'
+  ST_KEY,        // in a key
+  ST_COLON,      // after a key
+  ST_VALUE_WAIT, // after the ':'
+  ST_STRING,     // in a string value 
+  ST_SCALAR,     // in a number or a literal value
+  ST_NESTED,     // in an object or array value
+  ST_DONE        // after the closing '}' or invalid JSON, the rest of the message is ignored
+};
+
+void DomoStream::reset(void) {
+  state = ST_START;
+  depth = 0;
+  escaped = false;
+  quoted = false;
+  keyLen = 0;
+  valueLen = 0;
+  bytes = 0;
+  idx = 0;
+  switchType = -1;
+  type = -1;
+  hasSwitchType = false;
+  memset(&fields, 0, sizeof(fields));
+}
+
+bool DomoStream::result(domoScan_t* scan, domoFields_t* fields) {
+  scan->idx = idx;
+  scan->type = (hasSwitchType) ? switchType : type;
+  *fields = this->fields;
+  return scan->idx && scan->type >= 0;
+}
+
+// Called at the end of a top level string, number or literal value. Values 
+// that did not fit in the buffer (valueLen == SCAN_VALUE_SZ) are ignored.
+void DomoStream::endValue(void) {
+  if (keyLen >= SCAN_KEY_SZ) 
+    return;
+  key[keyLen] = 0;
+  bool complete = valueLen < SCAN_VALUE_SZ;
+  if (complete) 
+    value[valueLen] = 0;
+
+  if (!strcmp(key, "idx")) {
+    idx = (complete) ? strtoul(value, NULL, 10) : 0;
+  } else if (quoted && !strcmp(key, "switchType")) {
+    hasSwitchType = true;
+    switchType = (complete) ? domoDeviceType(value, valueLen) : -1;
+  } else if (quoted && !strcmp(key, "Type")) {
+    type = (complete) ? domoDeviceType(value, valueLen) : -1;
+  } else if (!complete) {
+    return;
+  } else if (!strcmp(key, "nvalue")) {
+    fields.nvalue = strtol(value, NULL, 10);
+  } else if (!strcmp(key, "Level")) {
+    fields.level = strtol(value, NULL, 10);
+  } else if (!strcmp(key, "svalue1")) {
+    fields.svalue1 = strtol(value, NULL, 10);
+  } else if (quoted && !strcmp(key, "Status")) {
+    strlcpy(fields.status, value, sizeof(fields.status));
+  }
+}
+
+size_t DomoStream::write(uint8_t c) {
+  bytes++;
+  bool white = (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+
+  switch (state) {
+    case ST_START:
+      if (c == '{') 
+        state = ST_KEY_WAIT;
+      else if (!white) 
+        state = ST_DONE;
+      break;
+
+    case ST_KEY_WAIT:
+      if (c == '"') {
+        keyLen = 0;
+        state = ST_KEY;
+      } else if (c == '}') 
+        state = ST_DONE;
+      else if (!white && c != ',') 
+        state = ST_DONE;
+      break;
+
+    case ST_KEY:
+      if (escaped) 
+        escaped = false;
+      else if (c == '\\') 
+        escaped = true;
+      else if (c == '"') {
+        state = ST_COLON;
+        break;
+      }  
+      if (keyLen < SCAN_KEY_SZ - 1) 
+        key[keyLen++] = c;
+      else
+        keyLen = SCAN_KEY_SZ;  // too long, not a key of interest
+      break;
+
+    case ST_COLON:
+      if (c == ':') 
+        state = ST_VALUE_WAIT;
+      else if (!white) 
+        state = ST_DONE;
+      break;
+
+    case ST_VALUE_WAIT:
+      if (white) 
+        break;
+      valueLen = 0;  
+      quoted = false;
+      if (c == '"') {
+        quoted = true;
+        state = ST_STRING;
+      } else if (c == '{' || c == '[') {
+        depth = 1;
+        state = ST_NESTED;
+      } else {
+        value[valueLen++] = c;
+        state = ST_SCALAR;
+      }
+      break;
+
+    case ST_STRING:
+      if (escaped) 
+        escaped = false;
+      else if (c == '\\') 
+        escaped = true;
+      else if (c == '"') {
+        endValue();
+        state = ST_KEY_WAIT;
+        break;
+      }
+      if (valueLen < SCAN_VALUE_SZ - 1) 
+        value[valueLen++] = c;
+      else
+        valueLen = SCAN_VALUE_SZ;
+      break;
+
+    case ST_SCALAR:
+      if (c == ',' || c == '}' || white) {
+        endValue();
+        state = (c == '}') ? ST_DONE : ST_KEY_WAIT;
+      } else if (valueLen < SCAN_VALUE_SZ - 1) 
+        value[valueLen++] = c;
+      else
+        valueLen = SCAN_VALUE_SZ;
+      break;
+
+    case ST_NESTED:
+      // quoted is true while in a string within the nested value
+      if (quoted) {
+        if (escaped) 
+          escaped = false;
+        else if (c == '\\') 
+          escaped = true;
+        else if (c == '"') 
+          quoted = false;
+      } else if (c == '"') 
+        quoted = true;
+      else if (c == '{' || c == '[') {
+        if (++depth == 0) 
+          state = ST_DONE;  // nested too deeply
+      } else if (c == '}' || c == ']') {
+        if (!--depth) 
+          state = ST_KEY_WAIT;
+      }
+      break;
+  }
+  return 1;
+}
@@ -0,0 +1,106 @@
+#ifndef DOMOSCAN_H
+#define DOMOSCAN_H
+
+#include <Arduino.h>
+
+/*
+ * Byte level scanner of Domoticz status messages
+ *
+ * Extracts the idx and the device type of a message published by Domoticz
+ * on the domoticz/out topic without decoding it with the JSON parser. Only 
+ * the top level members of the JSON object are examined, values of other
+ * fields are skipped over. The payload is not modified and does not need
+ * to be null terminated.
+ */
+
+typedef struct {
+  uint32_t idx;  // value of the "idx" field, 0 if not found 
+  int type;      // devtype_t matching the "switchType" or "Type" field, -1 if not found or not handled
+} domoScan_t;
+
+// Returns the devtype_t corresponding to the Domoticz switchType (or Type 
+// for scenes and groups) string of len characters or -1 if the type is 
+// not handled. The string does not need to be null terminated.
+int domoDeviceType(const char* s, size_t len);
+
+// Scans the length bytes of payload and fills scan. Returns true if
+// a non zero idx and a handled device type were found.
+bool scanDomoMessage(const char* payload, unsigned int length, domoScan_t* scan);
+
+// Values of the top level fields of a Domoticz status message used to 
+// update the status of a device. Fields not found are 0 or empty.
+typedef struct {
+  int32_t nvalue;   // "nvalue"
+  int32_t level;    // "Level" of dimmers
+  int32_t svalue1;  // "svalue1", a number in a string, selection level of selectors
+  char status[8];   // "Status" of groups: "On", "Off" or "Mixed"
+} domoFields_t;
+
+/*
+ * Compact state messages
+ *
+ * Retained messages published by a Domoticz event script or a companion
+ * program on <state topic>/device/<idx> and <state topic>/scene/<idx>. 
+ * The payload of a device is "<nvalue>[,<level>]" where level is the 
+ * dim level of dimmers or the selection level of selectors. The payload 
+ * of a group is its status: "On", "Off" or "Mixed".
+ */
+
+// subtopic is the part of the topic following "<state topic>/". Sets scene, 
+// idx and fields from the topic and the length bytes of payload. Returns 
+// false if the topic or the payload is not valid.
+bool scanStateMessage(const char* subtopic, const char* payload, unsigned int length, bool* scene, uint32_t* idx, domoFields_t* fields);
+
+/*
+ * Incremental scanner of Domoticz status messages
+ *
+ * A write only Stream that is given the payload of an MQTT message one
+ * byte at a time as it is read from the network by PubSubClient (see
+ * PubSubClient::setStream()). It keeps track of the position in the
+ * top level JSON object and retains only the values of the fields
+ * needed to identify the device and update its status. Its size is
+ * fixed, it does not depend on the length of the message.
+ */
+
+#define SCAN_KEY_SZ   12  // longest key retained is "switchType" 
+#define SCAN_VALUE_SZ 12  // longest string value retained is "Selector", longer values are ignored
+
+class DomoStream : public Stream {
+  public:
+    DomoStream() { reset(); }
+
+    // Prepares for the next message
+    void reset(void);
+
+    // Fills scan and fields with the values found in the message written
+    // since the last reset(). Returns true if a non zero idx and a handled
+    // device type were found.
+    bool result(domoScan_t* scan, domoFields_t* fields);
+
+    // Number of bytes written since the last reset()
+    uint32_t count(void) { return bytes; }
+
+    size_t write(uint8_t c) override;
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+
+  private:
+    void endValue(void);
+    uint8_t state;
+    uint8_t depth;            // nesting level inside a value that is an object or array
+    bool escaped;             // previous character was a \ in a string 
+    bool quoted;              // current value is a string 
+    uint8_t keyLen;
+    uint8_t valueLen;
+    char key[SCAN_KEY_SZ];
+    char value[SCAN_VALUE_SZ];
+    uint32_t bytes;
+    uint32_t idx;
+    int switchType;
+    int type;
+    bool hasSwitchType;
+    domoFields_t fields;
+};
+
+#endif
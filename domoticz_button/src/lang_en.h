@@ -10,6 +10,7 @@
 #define SC_BM_DEVICE_DIMMER "%s @ %d%%"
 #define SC_BM_DEVICE_SELECTOR "%s"
 #define SC_BM_DEVICE_OTHER "%s"
+#define SC_PENDING " ..."
 
 // function displayConfiguration()
 #define SC_CO_CONFIGURATION "--Configuration--"
@@ -32,10 +33,11 @@
 // functino WiFiManagerCallback()
 #define SC_ACCESS_POINT "Access Point"
 
-// mqttReconnect()
+// mqttConnection()
 #define SC_MQTT_CONNECTED0 "Connected to"
 #define SC_MQTT_CONNECTED1 "MQTT broker"
 #define SC_MQTT_CONNECTED2 "Updating..."
+#define SC_MQTT_SYNC "Updating %u/%u"
 
 #define SC_MQTT_NOT_CONNECTED0 "Not connected"
 #define SC_MQTT_NOT_CONNECTED1 "to MQTT broker"
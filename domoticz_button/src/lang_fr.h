@@ -10,6 +10,7 @@
 #define SC_BM_DEVICE_DIMMER "%s @ %d%%"
 #define SC_BM_DEVICE_SELECTOR "%s"
 #define SC_BM_DEVICE_OTHER "%s"
+#define SC_PENDING " ..."
 
 // function displayConfiguration()
 #define SC_CO_CONFIGURATION "--Configuration--"
@@ -32,10 +33,11 @@
 // functino WiFiManagerCallback()
 #define SC_ACCESS_POINT "Point d'accès"
 
-// mqttReconnect()
+// mqttConnection()
 #define SC_MQTT_CONNECTED0 "Connecté au"
 #define SC_MQTT_CONNECTED1 "serveur MQTT"
 #define SC_MQTT_CONNECTED2 "Mise à jour..."
+#define SC_MQTT_SYNC "Mise à jour %u/%u"
 
 #define SC_MQTT_NOT_CONNECTED0 "Déconnecté du"
 #define SC_MQTT_NOT_CONNECTED1 "serveur MQTT"
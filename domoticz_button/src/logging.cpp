@@ -5,6 +5,7 @@
 #include <cstdint>
 #include "config.h"
 #include "logging.h"
+#include "resolver.h"
 
 void mstostr(unsigned long milli, char* sbuf, int sbufsize) {
   int sec = milli / 1000;
@@ -52,7 +53,9 @@ void sendToLog(Log_level level, const char *line ) {
     #ifdef DEBUG_LOG
       Serial.printf("Sending %s to syslog %s:%d\n", message.c_str(), config.syslogHost, config.syslogPort);
     #endif  
-    if (udp.beginPacket(config.syslogHost, config.syslogPort)) {
+    // The line is not sent to syslog until the address of the server is known
+    IPAddress syslogIp;
+    if (resolveHost(config.syslogHost, syslogIp) == HOST_RESOLVED && udp.beginPacket(syslogIp, config.syslogPort)) {
       udp.write(message.c_str());
       udp.endPacket();
       delay(1);  // Add time for UDP handling 
@@ -17,6 +17,9 @@
 #include <ESP8266HTTPClient.h>  // HTTP protocol support for ESP8266
 #include <PubSubClient.h>       // MQTT client for Arduino framework
 #include <ArduinoJson.h>        // JSON library
+extern "C" {
+  #include <gpio.h>             // GPIO wake-up from light sleep
+}
 
 #include "SSD1306Wire.h"        // hardware driver for SSD1306 OLED display
 #include "roboto14.h"           // OLED display font
@@ -29,6 +32,17 @@
 #include "lang.h"                // i8n
 
 #include "devices.h"             // definitions of Domoticz devices, groups and scenes 
+#include "domoscan.h"            // pre-parse scanner of Domoticz MQTT messages
+#include "rxqueue.h"             // ingress queue of device status updates
+#include "domohttp.h"            // bulk status retrieval from the Domoticz HTTP API
+#include "rtcmem.h"              // device status snapshot kept across restarts
+#include "domocmd.h"             // encoder of commands sent to Domoticz
+#include "txqueue.h"             // commands held while not connected to the MQTT broker
+#include "acktrack.h"            // commands waiting for their acknowledgement by Domoticz
+#include "mqtttls.h"             // TLS transport of the MQTT client
+#include "resolver.h"            // cache of server addresses
+#include "discovery.h"           // mDNS discovery of the servers
+#include "wififast.h"            // Wi-Fi connection without scanning after a restart
 
 
 #ifndef SERIAL_BAUD
@@ -43,6 +57,23 @@
 WiFiClient mqttClient;
 PubSubClient mqtt_client(mqttClient);
 
+// MQTT brokers in order of preference, config.mqttHost followed by the 
+// backup brokers that are defined. See MQTT connection below.
+#define MQTT_BROKER_COUNT 3
+
+typedef struct {
+  const char* host;
+  uint16_t port;
+  uint16_t failures;     // consecutive failed connection attempts
+  uint32_t attempts;     // connection attempts
+  uint32_t connects;     // successful connections
+  uint32_t losses;       // connections lost
+} broker_t;
+
+broker_t brokers[MQTT_BROKER_COUNT];
+uint8_t brokerCount = 0;
+uint8_t broker = 0;      // index in brokers[] of the broker in use or to try next
+
 
 /* * * Domoticz button mode * * */
 
@@ -89,6 +120,7 @@ int8_t dimLevel = 0;               // temporary dim level 0-10 when editing dimm
 int8_t selChoice = 0;              // temporary selection choice when editing selector
 int8_t configChoice = 0;           // temporary choice in the configuration mode
 unsigned long alertAllowed = 0;    // number of miliseconds before alerts can resume
+bool inputReceived = false;        // true once the encoder has been turned or the button pressed
 
 
 /******************/
@@ -109,6 +141,7 @@ void minuteTimer(void) {
     minutetime = millis();
     if (alertAllowed > 0)
       alertAllowed--;      
+    checkWifiLease();
   }
 }  
 
@@ -166,23 +199,39 @@ void Show(char* top, char* middle, char* bottom, uint16_t waitTime = 0, bool ale
   delay(waitTime);
 }
 
+// true if a command for devices[index], or for one of the members if the 
+// device is a macro, has not been acknowledged yet
+bool isPending(uint16_t index) {
+  int m = findMacro(index);
+  if (m < 0)
+    return ackFind(index);
+  for (int k = 0; k < macros[m].count; k++) {
+    if (ackFind(macros[m].members[k]))
+      return true;
+  }
+  return false;
+}
+
 void displayDevice(uint16_t index, bool alert=false, bool sound=false) {
   // build bottom row
   char llbuf[32];  
   if (buttonMode == BM_DIM_LEVEL) {
       sprintf(llbuf, SC_BM_DIM_LEVEL, dimLevel * 10);
   } else if (buttonMode == BM_SELECTOR) {
-      sprintf(llbuf, SC_BM_SELECTOR, devicestatus[ selChoice + selectors[devices[index].xstatus].status0 ]);
+      sprintf(llbuf, SC_BM_SELECTOR, devicestatus[ selChoice + selectors[findSelector(index)].status0 ]);
   } else {  // (buttonmode == BM_DEVICES)
     if (devices[index].type == DT_DIMMER)
       sprintf(llbuf, SC_BM_DEVICE_DIMMER, devicestatus[devices[index].status], devices[index].xstatus * 10);
     else if (devices[index].type == DT_SELECTOR) {
-      sendToLogPf(LOG_DEBUG, PSTR("Selector %s, status %d, xstatus %d, status0 %d, statusCount %d"), 
-        devices[index].name, devices[index].status, devices[index].xstatus, selectors[devices[index].xstatus].status0, selectors[devices[index].xstatus].statusCount);
-      sprintf(llbuf, SC_BM_DEVICE_SELECTOR, devicestatus[ devices[index].status + selectors[devices[index].xstatus].status0 ]);
+      selector_t* sel = &selectors[findSelector(index)];
+      sendToLogPf(LOG_DEBUG, PSTR("Selector %s, status %d, status0 %d, statusCount %d"), 
+        devices[index].name, devices[index].status, sel->status0, sel->statusCount);
+      sprintf(llbuf, SC_BM_DEVICE_SELECTOR, devicestatus[ devices[index].status + sel->status0 ]);
     } else {
       sprintf(llbuf, SC_BM_DEVICE_OTHER, devicestatus[devices[index].status]);  
     }  
+    if (isPending(index))
+      strcat(llbuf, SC_PENDING);  // command not yet acknowledged
   } 
   Show( (char*) zones[devices[index].zone], (char *) devices[index].name, llbuf, 0, alert, sound);
   sendToLogPf(LOG_DEBUG, PSTR("Updated display for device %s.%s, alert %s, edit mode %s"), 
@@ -214,9 +263,9 @@ void displayInfo(void) {
   Show(config.hostname, (char*) SC_FIRMWARE_VERSION, (char*) String(VERSION).c_str(), config.infoTime);
   Show((char*) SC_WIFI_CONNECTED0, (char*) WiFi.localIP().toString().c_str(), (char*) "", config.infoTime);
   if (mqtt_client.connected()) 
-    Show( (char*) SC_MQTT_CONNECTED0, (char*) SC_MQTT_CONNECTED1, (char*) config.mqttHost, config.infoTime);
+    Show( (char*) SC_MQTT_CONNECTED0, (char*) SC_MQTT_CONNECTED1, (char*) brokers[broker].host, config.infoTime);
   else 
-    Show( (char*) SC_MQTT_NOT_CONNECTED0, (char*) SC_MQTT_NOT_CONNECTED1, (char*) config.mqttHost, config.infoTime);
+    Show( (char*) SC_MQTT_NOT_CONNECTED0, (char*) SC_MQTT_NOT_CONNECTED1, (char*) brokers[broker].host, config.infoTime);
 }
 
 /***********************/
@@ -232,6 +281,7 @@ void doRestart(bool resetCredentials = false) {
   display.drawString(64, MIDDLE_ROW, SC_RESTARTING);
   display.display();
   delay(config.infoTime);  // Enough time for messages to be sent.
+  rtcSaveDevices(cdev);    // restored in setup()
   ESP.restart();
   while (1) ; //ensure this functino does not return.
 }
@@ -244,6 +294,8 @@ void WiFiManagerCallback(WiFiManager *myWiFiManager) {
 
 void setup_wifi(void) {
   delay(10);
+  if (fastWifiConnect())
+    return;
   //Local WiFiManager, once its business is done, there is no need to keep it around
   WiFiManager wm;
   //wm.resetSettings();
@@ -254,6 +306,182 @@ void setup_wifi(void) {
   if (!wm.autoConnect())
     // Reboot. A.k.a. "Have you tried turning it Off and On again?"
     doRestart();
+  saveWifiConnection();
+}
+
+
+/****************************/
+/* * * Wi-Fi power save * * */
+/****************************/
+
+// While the display is blanked, nobody is using the button and the radio 
+// can sleep between the beacons of the access point, listening to only one
+// beacon in WIFI_LISTEN_INTERVAL. In light sleep the CPU is also stopped 
+// between beacons, so the encoder and push button pins are set to wake it 
+// as soon as they change, see setInputWake(). Any input wakes the radio 
+// before it is handled so that the answer of Domoticz to a command is not held by the
+// access point until the next beacon the radio listens to. The time between 
+// that input and the acknowledgement of the first command that follows is 
+// kept for each sleep mode the radio was woken from.
+
+#define WIFI_LISTEN_INTERVAL  3     // beacon intervals, about 100 ms each
+#define WIFI_IDLE_DELAY      10     // ms, loop() delay while blanked so that light sleep can start 
+#define WIFI_WAKE_WINDOW   5000     // ms, commands acknowledged later are not counted
+
+WiFiSleepType_t wifiSleep = WIFI_MODEM_SLEEP;  // default sleep mode of the SDK
+const char* wifiSleepNames[] = {"no sleep", "light sleep", "modem sleep"};  // WiFiSleepType_t
+
+typedef struct {
+  uint32_t wakes;         // times the radio was woken by an input
+  uint32_t acked;         // first commands after waking acknowledged in WIFI_WAKE_WINDOW
+  uint32_t totalLatency;  // ms
+  uint32_t maxLatency;    // ms
+} wakeStats_t;
+
+wakeStats_t wakeStats[3];        // indexed by WiFiSleepType_t of the radio before waking
+WiFiSleepType_t wokeFrom;
+unsigned long wakeTime = 0;      // time of the last wake, 0 once the following command has been acknowledged
+
+void setWifiSleep(WiFiSleepType_t type) {
+  if (!config.wifiSleep || type == wifiSleep)
+    return;
+  unsigned long start = micros();  
+  bool done = (type == WIFI_NONE_SLEEP) ? WiFi.setSleepMode(type) : WiFi.setSleepMode(type, WIFI_LISTEN_INTERVAL);
+  sendToLogPf(LOG_DEBUG, PSTR("Wi-Fi %s%s in %u us"), wifiSleepNames[type], (done) ? "" : " not set", (unsigned) (micros() - start));
+  if (done)  
+    wifiSleep = type;
+}
+
+// To be called on any input before handling it
+void wifiWake(void) {
+  if (!config.wifiSleep || wifiSleep == WIFI_NONE_SLEEP)
+    return;
+  wokeFrom = wifiSleep;  
+  wakeStats[wokeFrom].wakes++;
+  wakeTime = millis();
+  setWifiSleep(WIFI_NONE_SLEEP);
+}
+
+// To be called when the display is blanked
+void wifiDoze(void) {
+  setWifiSleep((config.wifiSleep == 2) ? WIFI_LIGHT_SLEEP : WIFI_MODEM_SLEEP);
+}
+
+// To be called when a command is acknowledged
+void wakeAcknowledged(void) {
+  if (!wakeTime)
+    return;
+  uint32_t latency = millis() - wakeTime;
+  wakeTime = 0;
+  if (latency > WIFI_WAKE_WINDOW)
+    return;
+  wakeStats_t& stats = wakeStats[wokeFrom];
+  stats.acked++;
+  stats.totalLatency += latency;
+  if (latency > stats.maxLatency)
+    stats.maxLatency = latency;
+  sendToLogPf(LOG_DEBUG, PSTR("First command after waking from %s acknowledged %u ms after the input"), wifiSleepNames[wokeFrom], (unsigned) latency);
+}
+
+void logWakeStats(void) {
+  for (int i = WIFI_LIGHT_SLEEP; i <= WIFI_MODEM_SLEEP; i++) {
+    wakeStats_t& stats = wakeStats[i];
+    if (stats.wakes)
+      sendToLogPf(LOG_INFO, PSTR("Woken from %s %u times, first command acknowledged in %u ms on average (max %u ms, %u commands)"), 
+        wifiSleepNames[i], (unsigned) stats.wakes, (unsigned) ((stats.acked) ? stats.totalLatency/stats.acked : 0), 
+        (unsigned) stats.maxLatency, (unsigned) stats.acked);
+  }
+}
+
+
+/************************************/
+/* * * Command acknowledgements * * */
+/************************************/
+
+// As soon as a command is published, the device shows the status it will
+// have once Domoticz has performed the command, with a pending marker. 
+// The status message published by Domoticz acknowledges the command and 
+// removes the marker. Status messages that do not match the expected 
+// status, for example the answer to an earlier status request, are not 
+// applied but become the status restored if the command is not 
+// acknowledged within ACK_TIMEOUT. Push off buttons and scenes have
+// no status and are not tracked.
+
+#define ACK_TIMEOUT 5000  // ms
+
+// Called when a command for devices[dev] has been published
+void expectAck(int dev, int32_t value, bool isLevel) {
+  devtype_t type = devices[dev].type;
+  if (type != DT_SWITCH && type != DT_DIMMER && type != DT_SELECTOR && type != DT_GROUP)
+    return;
+  ackrecord_t rec = {(uint16_t) dev, (uint8_t) type, (uint8_t) ((value) ? DS_ON : DS_OFF), -1, 
+    (uint8_t) devices[dev].status, (int16_t) devices[dev].xstatus, (uint32_t) millis()};
+  if (type == DT_SELECTOR)
+    rec.status = value / 10;          // selection level 0, 10, 20...
+  else if (type == DT_DIMMER && isLevel && value)
+    rec.xstatus = value / 10;         // dim level 0-100 
+  if (!ackPush(rec))
+    sendToLogP(LOG_ERR, PSTR("Too many commands waiting for an acknowledgement, oldest dropped"));
+  devices[dev].status = (devstatus_t) rec.status;
+  if (rec.xstatus >= 0)
+    devices[dev].xstatus = rec.xstatus;
+  if (dev == cdev && displayVisible)
+    displayNeedsUpdating = true;
+}
+
+// Called with the status of devices[i] reported by Domoticz. Returns false if 
+// that status must not be applied because the device shows the expected
+// status of a command that has not been acknowledged yet.
+bool acknowledge(int i, devstatus_t status, int32_t xstatus) {
+  ackrecord_t* rec = ackFind(i);
+  if (!rec)
+    return true;
+  if (status == rec->status && (rec->xstatus < 0 || xstatus == rec->xstatus)) {
+    uint32_t latency = ackDone(i, millis());
+    sendToLogPf(LOG_DEBUG, PSTR("Command for %s acknowledged in %u ms"), devices[i].name, (unsigned) latency);
+    wakeAcknowledged();
+    if (i == cdev && displayVisible)
+      displayNeedsUpdating = true;  // remove the pending marker
+    return true;
+  }
+  rec->prevStatus = status;
+  rec->prevXstatus = xstatus;
+  return false;
+}
+
+// Restores the previous status of devices for which commands have not 
+// been acknowledged in time. To be called in loop()
+void checkAcks(void) {
+  ackrecord_t rec;
+  while (ackExpired(millis(), ACK_TIMEOUT, rec)) {
+    devices[rec.index].status = (devstatus_t) rec.prevStatus;
+    devices[rec.index].xstatus = rec.prevXstatus;
+    sendToLogPf(LOG_WARNING, PSTR("Command for %s not acknowledged in %u ms, previous status restored"), 
+      devices[rec.index].name, ACK_TIMEOUT);
+    if (rec.index == cdev && displayVisible)
+      displayNeedsUpdating = true;
+  }
+}
+
+void logAckStats(void) {
+  char buffer[96];
+  for (int type = 0; type < DT_COUNT; type++) {
+    ackLatency_t& stats = ackLatency[type];
+    if (!stats.acked && !stats.timedOut)
+      continue;
+    size_t len = 0;
+    for (int k = 0; k < ACK_BUCKETS; k++) {
+      if (k < ACK_BUCKETS - 1)
+        len += snprintf(buffer + len, sizeof(buffer) - len, " <%u:%u", ackBucketLimits[k], (unsigned) stats.counts[k]);
+      else  
+        len += snprintf(buffer + len, sizeof(buffer) - len, " >=%u:%u", ackBucketLimits[k-1], (unsigned) stats.counts[k]);
+      if (len >= sizeof(buffer))
+        break;
+    }
+    sendToLogPf(LOG_INFO, PSTR("MQTT ack %s: %u acknowledged (avg %u ms, max %u ms), %u timed out, %u replaced, ms%s"),
+      devicetypes[type], (unsigned) stats.acked, (unsigned) ((stats.acked) ? stats.totalLatency / stats.acked : 0), 
+      (unsigned) stats.maxLatency, (unsigned) stats.timedOut, (unsigned) stats.replaced, buffer);
+  }
 }
 
 
@@ -261,226 +489,991 @@ void setup_wifi(void) {
 /* * * MQTT * * */
 /****************/
 
-// mqtt payload: {"command":"switchlight", "idx":IDX, "switchcmd":"VAL"} where IDX = integer, VAL =  On or Off
-// note 1. use for switches, push on, push off, dimmer (on/off only) etc.
-const char switchcmd[] = "{\"command\":\"switchlight\", \"idx\":%d, \"switchcmd\":\"%s\"}";
-
-// mqtt payload: {"command":"switchlight", "idx":IDX, "switchcmd":"Set Level", "level":VAL} where IDX = integer, VAL =  integer (0..100)
-// note 1. VAL = 0 turns dimmer off without changing dim level 
-// note 2. VAL > 0 sets dim level and turns light on
-// note 3. same command for Dimmer and Selector, see https://www.domoticz.com/wiki/Domoticz_API/JSON_URL%27s#Selector_Switch
-const char dimmercmd[] = "{\"command\":\"switchlight\", \"idx\":%d, \"switchcmd\":\"Set Level\", \"level\":%d}";
-
-// mqtt payload: {"command":"switchscene", "idx":IDX, "switchcmd":"VAL"} where IDX = integer, VAL =  On or Off
-// note 1. only ON possible for scenes
-// note 2. ON or OFF possible for groups
-const char  scenecmd[] = "{\"command\":\"switchscene\", \"idx\":%d, \"switchcmd\":\"%s\"}";
+// The commands are built by encodeCommand(), see domocmd.cpp for their format.
+// Devices with the DF_PUBLISH_OUT flag (push off buttons for which Domoticz does 
+// not publish a domoticz/out message) get a status message on domoticz/out instead.
+// Commands that cannot be published because the MQTT client is not connected 
+// are held in the outgoing queue and published by flushTxQueue() once the 
+// connection is restored, unless they are older than config.mqttCmdExpiry. 
+
+bool publishCommand(const char* topic, const char* buffer, size_t length) {
+  if (!mqtt_client.connected() || !mqtt_client.publish(topic, (const uint8_t*) buffer, length))
+    return false;
+  sendToLogPf(LOG_INFO, PSTR("MQTT: publish [%s] %s"), topic, buffer);
+  return true;
+}
 
 void send_domoticz_cmd(int dev, int32_t value, bool isLevel = false) {
-  char buffer[MSG_SZ];    
-
-  // Apparently sending { "command" : "switchlight", "idx" : 28, "switchcmd" : "Off" } to domoticz/in
-  // does not cause Domoticz to send a domoticz/out MQTT message. Need to investigate this further.
-  // In the mean time let's send the /out message directly to the IoT device
-  if (devices[dev].type == DT_PUSH_OFF && devices[dev].idx == 28) {
-    snprintf(buffer, MSG_SZ, "{ \"idx\" : %d, \"nvalue\" : 0 }", devices[dev].idx);
-    mqtt_client.publish(DOMO_PUB_TOPIC, buffer); 
-    sendToLogPf(LOG_INFO, PSTR("MQTT: publish [%s] %s"), DOMO_PUB_TOPIC, buffer);
-    return;
-  }  
-  if ( devices[dev].type == DT_SWITCH || (devices[dev].type == DT_DIMMER && !isLevel) ) 
-    snprintf(buffer, MSG_SZ, switchcmd, devices[dev].idx, (value) ? "On" : "Off");
-  else if (devices[dev].type == DT_DIMMER || devices[dev].type == DT_SELECTOR)
-    snprintf(buffer, MSG_SZ, dimmercmd, devices[dev].idx, value);
-  else if (devices[dev].type == DT_SCENE && value) 
-    snprintf(buffer, MSG_SZ, scenecmd, devices[dev].idx, "On");
-  else if (devices[dev].type == DT_GROUP) 
-    snprintf(buffer, MSG_SZ, scenecmd, devices[dev].idx, (value) ? "On" : "Off");
-  else {
+  char buffer[CMD_SZ];
+  const char* topic;
+
+  size_t length = encodeCommand(buffer, dev, value, isLevel, &topic);
+  if (!length) {
     sendToLogPf(LOG_ERR, PSTR("send_domoticz_cmd Not implement for type %s with value %d"), devicetypes[devices[dev].type], value);  
     return;
   }  
-  mqtt_client.publish(DOMO_SUB_TOPIC, buffer);
-  sendToLogPf(LOG_INFO, PSTR("MQTT: publish [%s] %s"), DOMO_SUB_TOPIC, buffer);
-}    
-
-void receivingMQTT(char const *topic, String const payload) {
-  //sendToLogPf(LOG_DEBUG, PSTR("MQTT rx %s"), payload.c_str()); //payload.substring(0, 80).c_str());
-  DynamicJsonDocument doc(config.mqttBufferSize);
-  DeserializationError err = deserializeJson(doc, payload);
-  if (err) {
-    sendToLogPf(LOG_ERR, PSTR("deserializeJson() failed : %s with message %s"), err.c_str(), payload.substring(0, 80).c_str());
+  if (!txPending() && publishCommand(topic, buffer, length)) {
+    expectAck(dev, value, isLevel);
     return;
   }
- 
-  int status;
-  int xstatus = 0;
-  devtype_t devType;
-  
-  int idx = doc["idx"];  // default 0 - not valid
-  if (!idx) {
-    sendToLogP(LOG_ERR, PSTR("idx not found in MQTT message"));
+  if (!config.mqttCmdExpiry) {
+    sendToLogPf(LOG_ERR, PSTR("Not connected to MQTT broker, command for %s lost"), devices[dev].name);
     return;
   }
+  txrecord_t rec = {(uint16_t) dev, isLevel, value, (uint32_t) millis()};
+  if (!txPush(rec))
+    sendToLogP(LOG_ERR, PSTR("Outgoing command queue full, oldest command dropped"));
+  sendToLogPf(LOG_INFO, PSTR("Not connected to MQTT broker, command for %s queued (%u pending)"), devices[dev].name, txPending());
+}
 
-  String sSwitchType = doc["switchType"];
+// Publishes the queued commands in order, to be called while connected 
+void flushTxQueue(void) {
+  txrecord_t rec;
+  char buffer[CMD_SZ];
+  const char* topic;
+
+  while (txPeek(rec)) {
+    uint32_t age = millis() - rec.time;
+    if (age > config.mqttCmdExpiry) {
+      txQueueStats.expired++;
+      sendToLogPf(LOG_INFO, PSTR("Queued command for %s dropped, %u s old"), devices[rec.index].name, (unsigned) (age/1000));
+    } else {
+      size_t length = encodeCommand(buffer, rec.index, rec.value, rec.isLevel, &topic);
+      if (!publishCommand(topic, buffer, length))
+        return;  // try again later
+      txQueueStats.replayed++;
+      expectAck(rec.index, rec.value, rec.isLevel);
+      sendToLogPf(LOG_DEBUG, PSTR("Replayed command for %s queued %u ms ago"), devices[rec.index].name, (unsigned) age);
+    }
+    txPop();
+  }
+}
 
-  if (sSwitchType.isEmpty()) 
-    sSwitchType = doc["Type"].as<String>();
+// Receive statistics. The JSON document used to decode messages gets
+// its memory from an allocator that counts heap requests, so that the
+// number of allocations made for each received message can be checked.
+
+struct mqttStats_t {
+  uint32_t messages;    // number of messages received from the MQTT broker
+  uint32_t idxMessages; // number of those messages received on per device topics
+  uint32_t accepted;    // number of messages for a device in devices[] 
+  uint32_t rejected;    // number of messages dropped by the pre-parse scanner
+  uint32_t allocs;      // total number of heap allocations made handling these messages
+  uint32_t maxAllocs;   // largest number of heap allocations made for a single message
+  uint32_t parseTime;   // total time spent in deserializeJson() (microseconds)
+  uint32_t maxParseTime;// longest time spent in deserializeJson() for a single message (microseconds)
+  uint16_t maxDocUsage; // largest number of bytes used in the JSON document
+  uint32_t minFreeHeap; // smallest amount of free heap seen when a message was handled
+  uint32_t oversized;   // number of messages larger than the PubSubClient buffer read with domoStream
+  uint32_t stateMessages; // number of messages received on the compact state topics
+} mqttStats = {0, 0, 0, 0, 0, 0, 0, 0, 0, UINT32_MAX, 0, 0};
+
+struct CountingAllocator {
+  void* allocate(size_t size) {
+    mqttStats.allocs++;
+    return malloc(size);
+  }
+  void deallocate(void* ptr) {
+    free(ptr);
+  }
+  void* reallocate(void* ptr, size_t size) {
+    mqttStats.allocs++;
+    return realloc(ptr, size);
+  }
+};
+
+typedef BasicJsonDocument<CountingAllocator> RxJsonDocument;
+
+// Domoticz status messages contain many more fields than those used here.
+// The filter tells deserializeJson() to skip all but the following fields 
+//   nvalue, Level, svalue1 (devices) and Status (groups) 
+// so that a small document allocated once can be reused for every message.
+// Since the payload is decoded in zero-copy mode, the document only holds
+// the object and its members, not the strings. The idx and the device type
+// are obtained beforehand with scanDomoMessage().
+
+#define RX_FIELD_COUNT  4
+#define RX_DOC_SIZE     JSON_OBJECT_SIZE(RX_FIELD_COUNT + 3)
 
-  if (sSwitchType.isEmpty()) {
-    sendToLogP(LOG_DEBUG, PSTR("Unknown device type in MQTT message"));
+RxJsonDocument rxDoc(RX_DOC_SIZE);
+StaticJsonDocument<JSON_OBJECT_SIZE(RX_FIELD_COUNT)> rxFilter;
+
+void initRxFilter(void) {
+  rxFilter["nvalue"] = true;
+  rxFilter["Level"] = true;
+  rxFilter["svalue1"] = true;
+  rxFilter["Status"] = true;
+}
+
+// When config.mqttStreaming is set, PubSubClient writes the payload of each
+// message to domoStream as it is read from the network and the callback gets 
+// the idx, device type and status fields from it instead of decoding the 
+// payload in the PubSubClient buffer. Messages larger than the buffer are 
+// then truncated in the buffer but not dropped, so config.mqttBufferSize 
+// only needs to hold the topic and the messages sent to the broker.
+
+DomoStream domoStream;
+
+void logMqttStats(void) {
+  sendToLogPf(LOG_INFO, PSTR("MQTT rx: %u messages (%u on per device topics, %u on state topics), %u accepted, %u rejected before parsing, %u heap allocations (max %u per message)"),
+    (unsigned) mqttStats.messages, (unsigned) mqttStats.idxMessages, (unsigned) mqttStats.stateMessages, (unsigned) mqttStats.accepted, (unsigned) mqttStats.rejected, 
+    (unsigned) mqttStats.allocs, (unsigned) mqttStats.maxAllocs);
+  if (config.mqttStreaming)
+    sendToLogPf(LOG_INFO, PSTR("MQTT rx: streaming, %u messages larger than the %u byte buffer"), 
+      (unsigned) mqttStats.oversized, mqtt_client.getBufferSize());
+  if (mqttStats.messages) 
+    sendToLogPf(LOG_INFO, PSTR("MQTT rx: parse time avg %u us, max %u us, JSON doc max %u of %u bytes, min free heap %u"),
+      (unsigned) (mqttStats.parseTime / mqttStats.messages), (unsigned) mqttStats.maxParseTime,
+      mqttStats.maxDocUsage, rxDoc.capacity(), (unsigned) mqttStats.minFreeHeap);
+  sendToLogPf(LOG_INFO, PSTR("MQTT rx queue: %u records, %u coalesced, %u dropped, high-water mark %u of %u"),
+    (unsigned) rxQueueStats.pushed, (unsigned) rxQueueStats.coalesced, (unsigned) rxQueueStats.dropped, 
+    rxQueueStats.highWater, RX_QUEUE_SIZE);  
+  sendToLogPf(LOG_INFO, PSTR("MQTT tx queue: %u commands queued, %u collapsed, %u dropped, %u expired, %u replayed"),
+    (unsigned) txQueueStats.queued, (unsigned) txQueueStats.collapsed, (unsigned) txQueueStats.dropped, 
+    (unsigned) txQueueStats.expired, (unsigned) txQueueStats.replayed);
+  logAckStats();
+}
+
+// Status parse routines, one for each device type with a status. Each 
+// gets the fields of the Domoticz message and updates the status and extra 
+// status in state which initially contains the current values of the device.
+
+typedef struct {
+  devstatus_t status;
+  int32_t xstatus;
+} devstate_t;
+
+typedef void (*statusParser_t)(const domoFields_t& fields, devstate_t& state);
+
+void parseSwitch(const domoFields_t& fields, devstate_t& state) {
+  state.status = (devstatus_t) (DS_OFF + fields.nvalue);
+}
+
+void parseDimmer(const domoFields_t& fields, devstate_t& state) {
+  // nvalue is 2 after a "Set Level" command, the dimmer is then on
+  state.status = (fields.nvalue) ? DS_ON : DS_OFF;
+  state.xstatus = fields.level / 10;
+}
+
+void parseContact(const domoFields_t& fields, devstate_t& state) {
+  state.status = (devstatus_t) (DS_CLOSED + fields.nvalue);
+}
+
+void parseSelector(const domoFields_t& fields, devstate_t& state) {
+  // nvalue means nothing, the selection level is in svalue1 
+  state.status = (devstatus_t) (fields.svalue1 / 10);
+}
+
+void parseGroup(const domoFields_t& fields, devstate_t& state) {
+  if (!strcmp(fields.status, "On"))
+    state.status = DS_ON;
+  else if (!strcmp(fields.status, "Mixed"))
+    state.status = DS_MIXED;
+  else  
+    state.status = DS_OFF;
+}
+
+// indexed by devtype_t
+const statusParser_t statusParsers[] = {
+  parseSwitch,    // DT_SWITCH
+  parseDimmer,    // DT_DIMMER
+  parseContact,   // DT_CONTACT
+  parseSelector,  // DT_SELECTOR
+  parseGroup,     // DT_GROUP
+  NULL,           // DT_PUSH_OFF: no status
+  NULL,           // DT_SCENE: no status
+  NULL            // DT_MACRO: status computed from its members
+};
+
+static_assert(sizeof(statusParsers)/sizeof(statusParsers[0]) == DT_COUNT, "statusParsers[] does not match devtype_t");
+
+// Computes the new status of devices[i] from the fields of a Domoticz message. 
+// The new status is not applied here, it is pushed in the ingress queue which 
+// is drained in loop() by processRxQueue().
+void pushDeviceStatus(int i, const domoFields_t& fields) {
+  statusParser_t parser = statusParsers[devices[i].type];
+  if (!parser)
     return;
-  }
-  
-  ////  if (sSwitchType.equals("On/Off"))
-  if (sSwitchType == "On/Off")
-    devType = DT_SWITCH;
-  else if (sSwitchType == "Dimmer")
-    devType = DT_DIMMER;
-  else if (sSwitchType == "Contact")
-    devType = DT_CONTACT;
-  else if (sSwitchType == "Selector")
-    devType = DT_SELECTOR;  
-  else if (sSwitchType = "Group")  
-    devType = DT_GROUP;
-  else {
-    sendToLogPf(LOG_DEBUG, PSTR("MQTT message %s ignored"), payload.substring(0, 80).c_str());
+  devstate_t state = {devices[i].status, devices[i].xstatus};
+  parser(fields, state);
+  rxrecord_t rec = {(uint16_t) i, (uint8_t) state.status, (int16_t) state.xstatus};
+  rxPush(rec);
+}
+
+// The payload is not null terminated and it is decoded in place: deserializeJson() 
+// is given a char* so that it runs in zero-copy mode, which means strings in doc point 
+// into the payload itself. The payload content is not valid after the call.
+// The message is for devices[i], found with the idx and device type returned
+// by scanDomoMessage(). 
+//
+void receivingMQTT(char const *topic, char *payload, unsigned int length, int i) {
+  if (!statusParsers[devices[i].type])
+    return;
+
+  //sendToLogPf(LOG_DEBUG, PSTR("MQTT rx %.*s"), length, payload);
+  RxJsonDocument& doc = rxDoc;
+  uint32_t parseTime = micros();
+  DeserializationError err = deserializeJson(doc, payload, length, DeserializationOption::Filter(rxFilter));
+  parseTime = micros() - parseTime;
+  mqttStats.parseTime += parseTime;
+  if (parseTime > mqttStats.maxParseTime) 
+    mqttStats.maxParseTime = parseTime;
+  if (doc.memoryUsage() > mqttStats.maxDocUsage)
+    mqttStats.maxDocUsage = doc.memoryUsage();  
+  if (err) {
+    sendToLogPf(LOG_ERR, PSTR("deserializeJson() failed : %s with message %.*s"), err.c_str(), (int) ((length < 80) ? length : 80), payload);
     return;
   }
-  
-  int i = findDevice(devType, idx);
+ 
+  domoFields_t fields;
+  fields.nvalue = doc["nvalue"].as<int>();
+  fields.level = doc["Level"].as<int>();
+  fields.svalue1 = doc["svalue1"].as<int>();
+  const char* sStatus = doc["Status"];
+  strlcpy(fields.status, (sStatus) ? sStatus : "", sizeof(fields.status));
+  pushDeviceStatus(i, fields);
+}
 
-  if (i < 0) {
-    int p = 128;
-    int n = payload.indexOf(String("\"name\" :"));
-    if (n < 0) n = payload.indexOf(String("\"Name\" :"));
-    if (n > 0) {
-      p = payload.indexOf(':', n);
-      n = p+1;
-      p = payload.indexOf(',', n);
+/* * * Initial status sync * * */
+
+// After connecting to the broker, the status of every device is requested 
+// from Domoticz. At most config.mqttSyncWindow requests are outstanding at 
+// any time, another one is sent each time an answer is received. The sync 
+// ends when all devices have answered or after config.mqttUpdateTime ms.
+// A request that is not answered within SYNC_REQUEST_TIMEOUT no longer
+// counts against the window and the device is marked SS_STALE, so that it 
+// is requested again in the second pass over devices[], unless that pass
+// has already gone past it. A device is thus requested twice at most and 
+// may be left unconfirmed. Each request is timed on its own, so a late 
+// answer frees no other slot.
+
+#define SYNC_REQUEST_TIMEOUT 1000  // ms
+#define SYNC_WINDOW_MAX        16  // upper limit of config.mqttSyncWindow
+
+// When compact state topics are used, the broker sends the retained state of 
+// the devices right after subscribing. Requests are only sent after this delay
+// for the devices without a retained state.
+#define SYNC_STATE_HOLDOFF    500  // ms
+
+const char infocmd[] = "{\"command\":\"get%sinfo\", \"idx\":%d}";
+
+struct {
+  bool active;
+  bool bootstrapped;          // status of devices obtained with HTTP before connecting, kept by the next sync
+  uint16_t next;              // index in devices[] of the next device to request, plus deviceCount
+                              // in the second pass over devices[] which requests SS_STALE devices
+  uint16_t inflight;          // number of unanswered requests in slots[]
+  uint16_t slots[SYNC_WINDOW_MAX];     // index in devices[] of the unanswered requests
+  unsigned long sent[SYNC_WINDOW_MAX]; // time each of these requests was sent (ms)
+  uint16_t total;             // number of devices to synchronize
+  uint16_t confirmed;         // number of devices that have answered
+  uint16_t requests;          // number of requests sent
+  uint16_t shown;             // confirmed count shown on the display
+  uint16_t holdoff;           // delay before sending the first request (ms)
+  unsigned long start;        // start time of the sync (ms)
+} statusSync;
+
+void startStatusSync(void) {
+  bool keep = statusSync.bootstrapped;
+  memset(&statusSync, 0, sizeof(statusSync));
+  for (int i = 0; i < deviceCount; i++) {
+    if (devices[i].type <= DT_GROUP) {
+      if (keep && devices[i].sync == SS_CONFIRMED)
+        statusSync.confirmed++;
+      else if (devices[i].sync != SS_STALE)  // restored devices are requested last
+        devices[i].sync = SS_NEEDED;
+      statusSync.total++;
     } else
-      n = 0;
-    sendToLogPf(LOG_DEBUG, PSTR("Device named %s not handled"), payload.substring(n, p).c_str());
-    return;
+      devices[i].sync = SS_NONE;
   }
+  statusSync.shown = UINT16_MAX;
+  statusSync.holdoff = (config.mqttStateTopic[0]) ? SYNC_STATE_HOLDOFF : 0;
+  statusSync.start = millis();
+  statusSync.active = (statusSync.total > 0);
+}
 
-  // get the device status and extra status if needed
-  if (devType < DT_GROUP) {
-    status = doc["nvalue"];
-    if (devType == DT_DIMMER) {
-      xstatus = doc["Level"];
-    } else if (devType == DT_SELECTOR) {
-      // status means nothing, replace with svalue1 
-      status = doc["svalue1"].as<int>()/10;
-      xstatus = findSelector(i);
-    }  
-  } else if (devType == DT_GROUP) {
-     String sStatus = doc["Status"];
-     if (sStatus.equals("On"))
-       status = DS_ON;
-     else if (sStatus.equals("Mixed"))
-       status = DS_MIXED;
-     else  
-       status = DS_OFF;
+// Called when a status message for devices[i] has been applied, whether 
+// it is the answer to a request or not
+void confirmStatusSync(int i) {
+  if (!statusSync.active || devices[i].sync == SS_NONE || devices[i].sync == SS_CONFIRMED)
+    return;
+  if (devices[i].sync == SS_REQUESTED) {
+    for (uint16_t k = 0; k < statusSync.inflight; k++) {
+      if (statusSync.slots[k] == (uint16_t) i) {
+        statusSync.inflight--;
+        statusSync.slots[k] = statusSync.slots[statusSync.inflight];  // order does not matter
+        statusSync.sent[k] = statusSync.sent[statusSync.inflight];
+        break;
+      }
+    }
+  }    
+  devices[i].sync = SS_CONFIRMED;
+  statusSync.confirmed++;
+}
+
+bool bootReady = false;  // true once the first sync has ended
+
+void endStatusSync(void) {
+  statusSync.active = false;
+  sendToLogPf(LOG_INFO, PSTR("Status of %u of %u devices received in %u ms, %u requests sent"),
+    statusSync.confirmed, statusSync.total, (unsigned) (millis() - statusSync.start), statusSync.requests);
+  if (!bootReady) {
+    bootReady = true;
+    sendToLogPf(LOG_INFO, PSTR("Ready %u ms after boot (status from %s)"), (unsigned) millis(), (config.domoBootstrap) ? "HTTP and MQTT" : "MQTT");
   }  
+  if (statusSync.confirmed < statusSync.total) {
+    for (int i = 0; i < deviceCount; i++) {
+      if (devices[i].sync == SS_NEEDED || devices[i].sync == SS_STALE || devices[i].sync == SS_REQUESTED)
+        sendToLogPf(LOG_DEBUG, PSTR("No status received for %s (idx %u)"), devices[i].name, (unsigned) devices[i].idx);
+    }
+  }
+  if (displayVisible)
+    displayNeedsUpdating = true;  
+}
 
-  switch (devType) {
-    case DT_SWITCH:   devices[i].status = (devstatus_t) (DS_OFF + status); break;
-    case DT_DIMMER:   devices[i].status = (devstatus_t) (DS_OFF + status); 
-                      devices[i].xstatus = xstatus / 10; break;
-    case DT_CONTACT:  devices[i].status = (devstatus_t) (DS_CLOSED + status); break;
-    case DT_SELECTOR: devices[i].status = (devstatus_t) status;
-                      devices[i].xstatus = xstatus; break;
-    case DT_GROUP:    devices[i].status = (devstatus_t) status; break;
-    default: /* DT_SCENE, DT_PUSH_OFF: nothing to do */ break;
+// Progress is only shown at boot, and only until the button is used
+bool showSyncProgress(void) {
+  return !bootReady && !inputReceived && displayVisible;
+}
+
+// To be called repeatedly while the sync is active
+void runStatusSync(void) {
+  if (!statusSync.active)
+    return;
+  uint16_t k = 0;
+  while (k < statusSync.inflight) {
+    if (millis() - statusSync.sent[k] > SYNC_REQUEST_TIMEOUT) {
+      // give up on this request, a late answer still confirms the device 
+      devices[statusSync.slots[k]].sync = SS_STALE;  // requested again in the second pass
+      statusSync.inflight--;
+      statusSync.slots[k] = statusSync.slots[statusSync.inflight];
+      statusSync.sent[k] = statusSync.sent[statusSync.inflight];
+    } else
+      k++;
   }
+  uint16_t window = (config.mqttSyncWindow < SYNC_WINDOW_MAX) ? config.mqttSyncWindow : SYNC_WINDOW_MAX;
+  char buffer[48];
+  while (millis() - statusSync.start >= statusSync.holdoff &&
+         statusSync.inflight < window && statusSync.next < 2*deviceCount) {
+    int i = statusSync.next % deviceCount;
+    if (devices[i].sync == ((statusSync.next < deviceCount) ? SS_NEEDED : SS_STALE)) {
+      snprintf(buffer, sizeof(buffer), infocmd, (devices[i].type == DT_GROUP) ? "scene" : "device", devices[i].idx);
+      if (!mqtt_client.publish(DOMO_SUB_TOPIC, buffer))
+        break;  // try again later
+      devices[i].sync = SS_REQUESTED;
+      statusSync.slots[statusSync.inflight] = i;
+      statusSync.sent[statusSync.inflight] = millis();
+      statusSync.inflight++;
+      statusSync.requests++;
+    }
+    statusSync.next++;
+  }
+  if (showSyncProgress() && statusSync.confirmed != statusSync.shown) {
+    statusSync.shown = statusSync.confirmed;
+    snprintf(buffer, sizeof(buffer), SC_MQTT_SYNC, statusSync.confirmed, statusSync.total);
+    Show( (char*) SC_MQTT_CONNECTED0, (char*) SC_MQTT_CONNECTED1, buffer);
+  }
+  if (statusSync.confirmed >= statusSync.total || millis() - statusSync.start > config.mqttUpdateTime)
+    endStatusSync();
+}
+
+void applyRxRecord(const rxrecord_t& rec) {
+  int i = rec.index;
+  confirmStatusSync(i);
+  if (!acknowledge(i, (devstatus_t) rec.status, rec.xstatus)) {
+    sendToLogPf(LOG_DEBUG, PSTR("Status %d of %s held back until its command is acknowledged"), rec.status, devices[i].name);
+    return;
+  }
+  devices[i].status = (devstatus_t) rec.status;
+  devices[i].xstatus = rec.xstatus;
 
   if (i == cdev && displayVisible) 
     displayNeedsUpdating = true;
 
-  if (devType == DT_DIMMER || devType == DT_SELECTOR) 
+  if (devices[i].type == DT_DIMMER) 
     sendToLogPf(LOG_DEBUG, PSTR("Set %s status to %d, xstatus to %d"), devices[i].name, devices[i].status, devices[i].xstatus); 
   else   
     sendToLogPf(LOG_DEBUG, PSTR("Set %s status to %d"), devices[i].name, devices[i].status); 
 }
 
+// Maximum time spent applying queued status updates in each loop() iteration.
+// At least one record is applied in each iteration. 
+#define RX_BUDGET 2000  // microseconds
+
+void processRxQueue(void) {
+  rxrecord_t rec;
+  unsigned long start = micros();
+  while (rxPop(rec)) {
+    applyRxRecord(rec);
+    if (micros() - start >= RX_BUDGET) 
+      break;
+  }
+}
+
+// Handles a message received on a compact state topic, subtopic is
+// the part of the topic after config.mqttStateTopic and the '/'
+void receivingState(const char* subtopic, const char* payload, unsigned int length) {
+  bool scene;
+  uint32_t idx;
+  domoFields_t fields;
+  int i = -1;
+  if (scanStateMessage(subtopic, payload, length, &scene, &idx, &fields)) {
+    if (scene)
+      i = findDevice(DT_GROUP, idx);
+    else {
+      // devices of all types with a status share the same idx space
+      for (int type = DT_SWITCH; type <= DT_SELECTOR && i < 0; type++)
+        i = findDevice((devtype_t) type, idx);
+    }
+  }
+  if (i < 0) {
+    mqttStats.rejected++;
+    return;
+  }
+  mqttStats.accepted++;
+  pushDeviceStatus(i, fields);
+}
+
+// Handler of devices found by fetchDomoticzStatus(), the record is applied 
+// at once so that the ingress queue does not fill up 
+void bootstrapDevice(int index, const domoFields_t& fields) {
+  pushDeviceStatus(index, fields);
+  processRxQueue();
+}
+
+// Gets the status of the devices from the Domoticz HTTP API before the first
+// connection to the broker, so that the requests, which block, are not made
+// in loop(). The devices found are not requested again by the sync that
+// starts once connected, which requests the others over MQTT.
+void bootstrapStatus(void) {
+  startStatusSync();
+  fetchDomoticzStatus(bootstrapDevice);
+  statusSync.active = false;
+  statusSync.bootstrapped = true;
+}
+
+/* * * Subscriptions * * */
+
+// QoS of subscriptions, see Persistent session below
+uint8_t mqttQos(void) {
+  return (config.mqttPersistent) ? 1 : 0;
+}
+
+// When config.mqttSubscribeMode is 1, the button subscribes to DOMO_PUB_TOPIC
+// and to the per device topics after connecting to the broker. At the end of 
+// a probe period, it keeps the per device topics and drops DOMO_PUB_TOPIC if 
+// Domoticz published anything on them. Otherwise it unsubscribes from the per 
+// device topics and uses DOMO_PUB_TOPIC as before.
+
+#define SUBSCRIBE_PROBE_TIME 10000  // probe duration (ms)
+
+enum subscription_t {
+  SUB_FLAT,        // subscribed to DOMO_PUB_TOPIC
+  SUB_PROBING,     // subscribed to DOMO_PUB_TOPIC and to per device topics
+  SUB_PER_DEVICE   // subscribed to per device topics
+} subscription = SUB_FLAT;
+
+unsigned long probeStart;
+
+struct {
+  uint32_t flat;       // messages received on DOMO_PUB_TOPIC during the probe
+  uint32_t unrelated;  // messages on DOMO_PUB_TOPIC not for a device in devices[] 
+  uint32_t idx;        // messages received on per device topics during the probe
+} probeStats;
+
+#define IDX_TAG "${idx}"
+
+// Copies config.mqttIdxTopic into buf, replacing ${idx} with the given idx
+void makeIdxTopic(char* buf, size_t size, uint32_t idx) {
+  const char* p = strstr(config.mqttIdxTopic, IDX_TAG);
+  snprintf(buf, size, "%.*s%u%s", (int) (p - config.mqttIdxTopic), config.mqttIdxTopic, (unsigned) idx, p + strlen(IDX_TAG));
+}
+
+// Subscribes or unsubscribes to the per device topic of all devices that have 
+// a status. Domoticz idx are unique by device type only, but the topic
+// only contains the idx so there is one subscription per distinct idx.
+void subscribeIdxTopics(bool subscribe) {
+  char topic[TOPIC_SZ + 12];
+  int count = 0;
+  for (int i = 0; i < deviceCount; i++) {
+    if (devices[i].type > DT_GROUP) continue;
+    int k;
+    for (k = 0; k < i; k++) {
+      if (devices[k].type <= DT_GROUP && devices[k].idx == devices[i].idx) break;
+    }
+    if (k < i) continue;  // already done
+    makeIdxTopic(topic, sizeof(topic), devices[i].idx);
+    if (subscribe) 
+      mqtt_client.subscribe(topic, mqttQos());
+    else  
+      mqtt_client.unsubscribe(topic);
+    count++;  
+  }
+  sendToLogPf(LOG_DEBUG, PSTR("%s %d per device topics"), (subscribe) ? "Subscribed to" : "Unsubscribed from", count);
+}
+
+// To be called at regular intervals while connected, ends the probe period
+void checkSubscription(void) {
+  if (subscription != SUB_PROBING || millis() - probeStart < SUBSCRIBE_PROBE_TIME) 
+    return;
+  if (probeStats.idx) {
+    mqtt_client.unsubscribe(DOMO_PUB_TOPIC);
+    subscription = SUB_PER_DEVICE;
+    sendToLogPf(LOG_INFO, PSTR("Using per device topics, %u messages received on them during the probe"), (unsigned) probeStats.idx);
+    sendToLogPf(LOG_INFO, PSTR("%u messages received on %s in %u s, %u (%u%%) for other devices are now filtered out by the broker"), 
+      (unsigned) probeStats.flat, DOMO_PUB_TOPIC, SUBSCRIBE_PROBE_TIME/1000, (unsigned) probeStats.unrelated, 
+      (unsigned) ((probeStats.flat) ? 100*probeStats.unrelated/probeStats.flat : 0));
+  } else {
+    subscribeIdxTopics(false);
+    subscription = SUB_FLAT;
+    sendToLogPf(LOG_INFO, PSTR("Nothing received on per device topics, using %s"), DOMO_PUB_TOPIC);
+  }
+}
+
+/* * * Persistent session * * */
+
+// When config.mqttPersistent is set, the button connects with cleanSession
+// false and subscribes at QoS 1, so the broker keeps the subscriptions and 
+// queues the messages published while the button is disconnected. Since
+// PubSubClient does not report whether the broker resumed the session, the 
+// button subscribes to its own SESSION_TOPIC and, on reconnecting, publishes
+// a marker on it without resubscribing. If the marker comes back, the session
+// was resumed and the queued messages have been replayed before it. Otherwise
+// the session expired and the button subscribes and syncs all devices again.
+
+#define SESSION_TOPIC      "%s/session"  // %s replaced with config.hostname
+#define SESSION_PROBE_TIME 2000          // maximum wait for the marker (ms)
+
+char sessionTopic[HOST_NAME_SZ + 9];
+char sessionMarker[12];
+bool sessionSubscribed = false;  // subscriptions made with cleanSession false
+bool sessionMarkerReceived;
+
+struct {
+  uint32_t resumed;   // reconnections without a full resync 
+  uint32_t expired;   // reconnections where the session had expired 
+  uint32_t replayed;  // messages received before the marker on resumed sessions
+} sessionStats;
+
+uint32_t sessionMessages;  // mqttStats.messages when the marker was published
+unsigned long sessionProbeStart;
+
+// Publishes the marker, mqttConnection() then waits for it to come back
+void startSessionProbe(void) {
+  sessionMessages = mqttStats.messages;
+  snprintf(sessionMarker, sizeof(sessionMarker), "%lu", millis());
+  sessionMarkerReceived = false;
+  sessionProbeStart = millis();
+  mqtt_client.publish(sessionTopic, sessionMarker);
+}
+
+// Called once the marker is back or after SESSION_PROBE_TIME
+void endSessionProbe(void) {
+  if (!sessionMarkerReceived) {
+    sessionStats.expired++;
+    sendToLogPf(LOG_INFO, PSTR("MQTT session expired, full resync (%u sessions expired, %u resumed)"), 
+      (unsigned) sessionStats.expired, (unsigned) sessionStats.resumed);
+    return;
+  }
+  uint32_t messages = mqttStats.messages - sessionMessages;
+  sessionStats.resumed++;
+  sessionStats.replayed += messages;
+  sendToLogPf(LOG_INFO, PSTR("MQTT session resumed in %u ms, %u queued messages replayed, %u full resyncs avoided (%u messages replayed in all)"),
+    (unsigned) (millis() - sessionProbeStart), (unsigned) messages, (unsigned) sessionStats.resumed, (unsigned) sessionStats.replayed);
+}
+
 // Callback function, when we receive an MQTT value on the topics
-// subscribed this function is called
+// subscribed this function is called. The payload is handled directly 
+// in the PubSubClient buffer, nothing is copied to the heap.
+// Messages without an idx, with an unhandled device type or for a device
+// that is not in devices[] are dropped before the JSON parser is invoked.
+// In streaming mode, the payload has already been scanned by domoStream
+// and the JSON parser is not used at all.
 void mqttCallback(char* topic, byte* payload, unsigned int length) {
-  byte* payload_copy = reinterpret_cast<byte*>(malloc(length + 1));
-  if (payload_copy == NULL) {
-    sendToLogP(LOG_ERR, PSTR("Can't allocate memory for MQTT payload. Message ignored"));
+  uint32_t allocs = mqttStats.allocs;
+  domoScan_t scan;
+  int i = -1;
+
+  if (sessionSubscribed && !strcmp(topic, sessionTopic)) {
+    domoStream.reset();
+    if (length == strlen(sessionMarker) && !memcmp(payload, sessionMarker, length))
+      sessionMarkerReceived = true;
     return;
   }
-  // Copy the payload to the new buffer
-  memcpy(payload_copy, payload, length);
-  // Conversion to a printable string
-  payload_copy[length] = '\0';
 
-  // launch the function to treat received data
-  receivingMQTT(topic, (char *)payload_copy);
+  bool flat = !strcmp(topic, DOMO_PUB_TOPIC);
+  size_t stateLen = strlen(config.mqttStateTopic);
+  bool state = stateLen && !strncmp(topic, config.mqttStateTopic, stateLen) && topic[stateLen] == '/';
+
+  if (state) {
+    domoStream.reset();  // compact payload, always entirely in the buffer
+    mqttStats.stateMessages++;
+    receivingState(topic + stateLen + 1, (char *) payload, length);
+  } else if (config.mqttStreaming) {
+    // the whole payload went through domoStream, payload may be truncated
+    domoFields_t fields;
+    if (domoStream.count() > length)
+      mqttStats.oversized++;
+    if (domoStream.result(&scan, &fields))
+      i = findDevice((devtype_t) scan.type, scan.idx);
+    domoStream.reset();  
+    if (i >= 0) {
+      mqttStats.accepted++;
+      pushDeviceStatus(i, fields);
+    } else {
+      mqttStats.rejected++;
+    }
+  } else {
+    if (scanDomoMessage((char *) payload, length, &scan))
+      i = findDevice((devtype_t) scan.type, scan.idx);
+    if (i >= 0) {
+      mqttStats.accepted++;
+      receivingMQTT(topic, (char *) payload, length, i);
+    } else {
+      mqttStats.rejected++;
+    }
+  }
 
-  // Free the memory
-  free(payload_copy);
-}
+  if (!flat && !state)
+    mqttStats.idxMessages++;
+  if (subscription == SUB_PROBING && !state) {
+    if (!flat)
+      probeStats.idx++;
+    else {
+      probeStats.flat++;
+      if (i < 0) probeStats.unrelated++;
+    }
+  }
 
-const char infocmd[] = "{\"command\":\"get%sinfo\", \"idx\":%d}";
+  allocs = mqttStats.allocs - allocs;
+  mqttStats.messages++;
+  if (ESP.getFreeHeap() < mqttStats.minFreeHeap)
+    mqttStats.minFreeHeap = ESP.getFreeHeap();
+  if (allocs > mqttStats.maxAllocs)
+    mqttStats.maxAllocs = allocs;
+}
 
 void mqttSubscribe(void) {
-  char buffer[MSG_SZ];  
-  mqtt_client.subscribe(DOMO_PUB_TOPIC);
-  // update the status of all devices
-  for (int i=0; i < deviceCount; i++) {
-    if (devices[i].type <= DT_GROUP) {
-      snprintf(buffer, MSG_SZ, infocmd, (devices[i].type == DT_GROUP) ? "scene" : "device", devices[i].idx);
-      mqtt_client.publish(DOMO_SUB_TOPIC, buffer);
-    }   
+  if (config.mqttStateTopic[0]) {
+    // the broker immediately sends the retained state of each device
+    char topic[TOPIC_SZ + 2];
+    snprintf(topic, sizeof(topic), "%s/#", config.mqttStateTopic);
+    mqtt_client.subscribe(topic, mqttQos());
+  }
+  mqtt_client.subscribe(DOMO_PUB_TOPIC, mqttQos());
+  subscription = SUB_FLAT;
+  if (config.mqttSubscribeMode) {
+    if (strstr(config.mqttIdxTopic, IDX_TAG)) {
+      subscribeIdxTopics(true);
+      subscription = SUB_PROBING;
+      memset(&probeStats, 0, sizeof(probeStats));
+      probeStart = millis();
+    } else 
+      sendToLogPf(LOG_ERR, PSTR("No %s in per device topic %s"), IDX_TAG, config.mqttIdxTopic);  
+  }
+  sessionSubscribed = config.mqttPersistent;
+  if (sessionSubscribed) {
+    snprintf(sessionTopic, sizeof(sessionTopic), SESSION_TOPIC, config.hostname);
+    mqtt_client.subscribe(sessionTopic, 1);
+  }
+}
+
+/* * * MQTT connection * * */
+
+// The connection to the broker is managed by a state machine advanced by 
+// mqttConnection() in each loop() iteration, so the rotary encoder and the 
+// push button are not blocked while the button connects, resumes its session 
+// or synchronizes the status of the devices. PubSubClient::connect() is the 
+// only blocking step, for at most MQTT_TCP_TIMEOUT to open the connection 
+// plus MQTT_CONNACK_TIMEOUT to get the answer of the broker. A failed attempt 
+// is retried after a delay that doubles after each failure, from 
+// MQTT_BACKOFF_MIN up to MQTT_CONNECT_INTERVAL, and of which a random part
+// is drawn so that buttons restarted together do not hit the broker at the
+// same time.
+//
+// When backup brokers are defined, a failed attempt or a lost connection is 
+// followed at once by an attempt on the next broker in brokers[], the delay 
+// only applies once every broker has failed in turn. While connected to a 
+// backup broker, a TCP connection to the first broker is attempted every 
+// MQTT_PRIMARY_PROBE_INTERVAL while the display is blanked, since the probe 
+// blocks for up to MQTT_PRIMARY_PROBE_TIMEOUT and nobody is using the button 
+// then. After MQTT_PRIMARY_HEALTHY successful probes in a row, the button 
+// disconnects and returns to the first broker. The 
+// subscriptions of a persistent session do not exist on another broker, so 
+// the session is not probed after switching brokers.
+
+#define MQTT_TCP_TIMEOUT      1500  // ms
+#define MQTT_TLS_TIMEOUT      5000  // ms, a full TLS handshake can take a few seconds
+#define MQTT_CONNACK_TIMEOUT     3  // s, also the PubSubClient read timeout
+#define MQTT_BACKOFF_MIN      2000  // ms
+#define MQTT_CONNECT_INTERVAL 60000 // ms, maximum delay between attempts
+
+// Maximum delay used while commands are waiting in the outgoing queue
+#define MQTT_CONNECT_INTERVAL_PENDING 5000
+
+#define MQTT_PRIMARY_PROBE_INTERVAL 30000  // ms
+#define MQTT_PRIMARY_PROBE_TIMEOUT    500  // ms
+#define MQTT_PRIMARY_HEALTHY            2  // successful probes before switching back
+
+enum mqttState_t {
+  MS_IDLE,      // not connected, waiting for the next attempt
+  MS_RESUMING,  // connected, waiting for the session marker
+  MS_SYNCING,   // connected and subscribed, status sync in progress
+  MS_CONNECTED  // connected and synchronized
+};
+
+struct {
+  mqttState_t state;
+  unsigned long lastAttempt;  // time of the last connection attempt or loss (ms)
+  uint32_t delay;             // delay before the next attempt (ms)
+  uint32_t backoff;           // current upper limit of the delay (ms)
+  uint16_t failures;          // consecutive failed attempts
+  int8_t connected;           // index in brokers[] of the last broker connected, -1 if none
+  unsigned long lost;         // time the connection was lost, 0 if it was not (ms)
+  unsigned long lastProbe;    // time of the last probe of the first broker (ms)
+  uint8_t probes;             // consecutive successful probes of the first broker
+  bool tlsReady;              // false if the TLS certificate checks are misconfigured
+} mqttConn = {MS_IDLE, 0, 0, MQTT_BACKOFF_MIN, 0, -1, 0, 0, 0, false};
+
+void addBroker(const char* host, uint16_t port) {
+  if (!host[0] || brokerCount >= MQTT_BROKER_COUNT)
+    return;
+  memset(&brokers[brokerCount], 0, sizeof(broker_t));
+  brokers[brokerCount].host = host;
+  brokers[brokerCount].port = port;
+  brokerCount++;
+}
+
+void initMqttConnection(void) {
+  brokerCount = 0;
+  addBroker(config.mqttHost, config.mqttPort);
+  addBroker(config.mqttHost2, config.mqttPort2);
+  addBroker(config.mqttHost3, config.mqttPort3);
+  if (!brokerCount) {
+    brokers[0].host = config.mqttHost;  // empty, connection attempts will fail 
+    brokers[0].port = config.mqttPort;
+    brokerCount = 1;
+  }
+  broker = 0;
+  mqttClient.setTimeout(MQTT_TCP_TIMEOUT);
+  if (config.mqttTls) {
+    mqttConn.tlsReady = initMqttTls();
+    mqttTlsClient.setTimeout(MQTT_TLS_TIMEOUT);
+    mqtt_client.setClient(mqttTlsClient);
   }  
+  mqtt_client.setSocketTimeout(MQTT_CONNACK_TIMEOUT);
 }
 
-void mqttReconnect(void) {
-  sendToLogP(LOG_DEBUG, PSTR("Reconnecting to MQTT broker"));  
+void logBrokerStats(void) {
+  for (int i = 0; i < brokerCount; i++) 
+    sendToLogPf(LOG_INFO, PSTR("MQTT broker %s:%u%s: %u attempts, %u connections, %u lost, %u consecutive failures"),
+      brokers[i].host, brokers[i].port, (i == broker && mqtt_client.connected()) ? " (in use)" : "",
+      (unsigned) brokers[i].attempts, (unsigned) brokers[i].connects, (unsigned) brokers[i].losses, brokers[i].failures);
+}
+
+// Returns true once the first broker has accepted MQTT_PRIMARY_HEALTHY TCP 
+// connections in a row, to be called while connected to a backup broker.
+// The first broker is only probed while the display is blanked.
+bool primaryHealthy(void) {
+  if (buttonMode != BM_BLANKED || millis() - mqttConn.lastProbe < MQTT_PRIMARY_PROBE_INTERVAL)
+    return false;
+  WiFiClient probe;
+  IPAddress ip;
+  probe.setTimeout(MQTT_PRIMARY_PROBE_TIMEOUT);
+  if (resolveHost(brokers[0].host, ip) == HOST_RESOLVED && probe.connect(ip, brokers[0].port)) {
+    probe.stop();
+    mqttConn.probes++;
+  } else 
+    mqttConn.probes = 0;
+  mqttConn.lastProbe = millis();
+  return mqttConn.probes >= MQTT_PRIMARY_HEALTHY;
+}
+
+bool mqttConnect(void) {
+  IPAddress ip;
+  hostStatus_t resolved = resolveHost(brokers[broker].host, ip);
+  // BearSSL needs the host name to check the certificate against the trust 
+  // anchors, WiFiClientSecure then looks it up again with WiFi.hostByName() 
+  // which only returns at once if the name is in the lwIP DNS table
+  bool byName = mqttTlsNeedsHostName();
+  if (byName && resolved == HOST_RESOLVED)
+    resolved = refreshHost(brokers[broker].host, ip);
+  if (resolved == HOST_PENDING)
+    return false;  // tried again in the next loop() iteration
+  if (config.mqttTls && mqttConn.tlsReady && !mqttTlsClockReady())
+    return false;  // tried again once NTP has answered
+  sendToLogPf(LOG_DEBUG, PSTR("Connecting to MQTT broker %s:%u"), brokers[broker].host, brokers[broker].port);  
+  if (byName)
+    mqtt_client.setServer(brokers[broker].host, brokers[broker].port);
+  else  
+    mqtt_client.setServer(ip, brokers[broker].port);
+  brokers[broker].attempts++;
+  domoStream.reset();  // discard any partial message from the lost connection
+  bool cleanSession = !config.mqttPersistent;
+  uint32_t heap = ESP.getFreeHeap();
+  bool useTls = config.mqttTls && mqttConn.tlsReady && resolved == HOST_RESOLVED;
+  if (useTls) 
+    prepareMqttTls(broker, brokers[broker].host, brokers[broker].port);
+  unsigned long start = millis();
   bool connected = false;
-  if (!strlen(config.mqttUser) || !strlen(config.mqttPswd)) {
-    //dbg: sendToLogP(LOG_DEBUG, PSTR("Attempt to connect, no auth"));
-    connected = mqtt_client.connect(config.hostname);
+  if (resolved != HOST_RESOLVED)
+    sendToLogPf(LOG_ERR, PSTR("Could not resolve the address of MQTT broker %s"), brokers[broker].host);
+  else if (config.mqttTls && !mqttConn.tlsReady)
+    sendToLogP(LOG_ERR, PSTR("TLS: the certificate of the MQTT broker cannot be checked, see the log at boot"));
+  else if (!strlen(config.mqttUser) || !strlen(config.mqttPswd)) 
+    connected = mqtt_client.connect(config.hostname, NULL, NULL, NULL, 0, false, NULL, cleanSession);
+  else 
+    connected = mqtt_client.connect(config.hostname, config.mqttUser, config.mqttPswd, NULL, 0, false, NULL, cleanSession);  
+  mqttConn.lastAttempt = millis();
+  if (useTls) 
+    reportMqttTls(broker, brokers[broker].host, brokers[broker].port, connected, millis() - start, heap);
+  if (connected) {
+    sendToLogPf(LOG_INFO, PSTR("Connected to MQTT broker %s as %s in %u ms"), brokers[broker].host, config.hostname, (unsigned) (millis() - start));
+    if (mqttConn.lost)
+      sendToLogPf(LOG_INFO, PSTR("MQTT connection restored %u ms after it was lost"), (unsigned) (millis() - mqttConn.lost));
+    if (mqttConn.connected != broker)
+      sessionSubscribed = false;  // the session, if any, is on another broker
+    mqttConn.connected = broker;
+    mqttConn.lost = 0;
+    mqttConn.failures = 0;
+    mqttConn.backoff = MQTT_BACKOFF_MIN;
+    mqttConn.probes = 0;
+    mqttConn.lastProbe = millis();
+    brokers[broker].failures = 0;
+    brokers[broker].connects++;
   } else {
-    //dbg: sendToLogPf(LOG_DEBUG, PSTR("Attempt to connect, user \"%s\", pswd \"%s\""), config.mqttUser, config.mqttPswd);
-    connected = mqtt_client.connect(config.hostname, config.mqttUser, config.mqttPswd);  
+    brokers[broker].failures++;
+    mqttConn.failures++;
+    broker = (broker + 1) % brokerCount;
+    if (mqttConn.failures % brokerCount) {
+      mqttConn.delay = 0;  // try the next broker at once
+    } else if (buttonMode == BM_BLANKED && rediscoverServer(SRV_MQTT)) {  // the query blocks for MDNS_BROWSE_TIME
+      broker = 0;  // the first broker has moved
+      brokers[0].port = config.mqttPort;
+      mqttConn.delay = 0;
+    } else {
+      mqttConn.delay = mqttConn.backoff/2 + random(mqttConn.backoff/2 + 1);
+      mqttConn.backoff = (mqttConn.backoff < MQTT_CONNECT_INTERVAL/2) ? 2*mqttConn.backoff : MQTT_CONNECT_INTERVAL;
+    }  
+    sendToLogPf(LOG_ERR, PSTR("Could not connect to MQTT broker (state %d, %u failures in %u ms), next attempt on %s in %u ms"),  
+      mqtt_client.state(), mqttConn.failures, (unsigned) (millis() - start), brokers[broker].host, (unsigned) mqttConn.delay);
+  }  
+  return connected;  
+}
+
+// Subscribes and starts the status sync of all devices
+void startFullSync(void) {
+  mqttSubscribe();
+  if (showSyncProgress())
+    Show( (char*) SC_MQTT_CONNECTED0, (char*) SC_MQTT_CONNECTED1, (char*) SC_MQTT_CONNECTED2);
+  startStatusSync();
+  mqttConn.state = MS_SYNCING;
+}
+
+// To be called in each loop() iteration 
+void mqttConnection(void) {
+  if (mqttConn.state != MS_IDLE && !mqtt_client.connected()) {
+    sendToLogPf(LOG_ERR, PSTR("Lost connection to MQTT broker %s (state %d)"), brokers[broker].host, mqtt_client.state());
+    if (statusSync.active) 
+      endStatusSync();
+    brokers[broker].losses++;
+    mqttConn.state = MS_IDLE;
+    mqttConn.lost = mqttConn.lastAttempt = millis();
+    mqttConn.delay = 0;  // first attempt at once
+    if (brokerCount > 1) {
+      // the broker just lost counts as the first failure of the round
+      brokers[broker].failures++;
+      mqttConn.failures = 1;
+      broker = (broker + 1) % brokerCount;
+    } 
   }
-  if (connected) { 
-    sendToLogPf(LOG_INFO, PSTR("Reconnected to MQTT broker %s as %s"), config.mqttHost, config.hostname);
-    mqttSubscribe();
-    Show( (char*) SC_MQTT_CONNECTED0, (char*) SC_MQTT_CONNECTED1, (char*) SC_MQTT_CONNECTED2, config.mqttUpdateTime);
-  } else {
-    sendToLogP(LOG_ERR, PSTR("Could not connect to MQTT broker"));  
-    Show( (char*) SC_MQTT_NOT_CONNECTED0, (char*) SC_MQTT_NOT_CONNECTED1, (char*) SC_MQTT_NOT_CONNECTED2, config.infoTime);
+
+  switch (mqttConn.state) {
+    case MS_IDLE: {
+      uint32_t wait = mqttConn.delay;
+      if (txPending() && wait > MQTT_CONNECT_INTERVAL_PENDING) 
+        wait = MQTT_CONNECT_INTERVAL_PENDING;
+      if (millis() - mqttConn.lastAttempt < wait || !mqttConnect())
+        break;
+      if (sessionSubscribed && config.mqttPersistent) {
+        startSessionProbe();
+        mqttConn.state = MS_RESUMING;
+      } else 
+        startFullSync();
+      break;
+    }  
+    case MS_RESUMING:
+      mqtt_client.loop();
+      if (sessionMarkerReceived || millis() - sessionProbeStart >= SESSION_PROBE_TIME) {
+        endSessionProbe();
+        if (sessionMarkerReceived)
+          mqttConn.state = MS_CONNECTED;  // subscriptions kept and missed messages replayed by the broker
+        else
+          startFullSync();
+      }
+      break;
+    case MS_SYNCING:
+      mqtt_client.loop();
+      runStatusSync();
+      if (!statusSync.active)
+        mqttConn.state = MS_CONNECTED;
+      break;
+    case MS_CONNECTED:
+      mqtt_client.loop();
+      checkSubscription();
+      if (txPending())
+        flushTxQueue();
+      if (config.mqttTls && buttonMode == BM_BLANKED)
+        probeMqttTls();
+      if (broker && primaryHealthy()) {
+        sendToLogPf(LOG_INFO, PSTR("MQTT broker %s is reachable again, leaving %s"), brokers[0].host, brokers[broker].host);
+        mqtt_client.disconnect();
+        broker = 0;
+        brokers[0].failures = 0;
+        mqttConn.state = MS_IDLE;
+        mqttConn.failures = 0;
+        mqttConn.delay = 0;
+        mqttConn.lost = millis();  // to log the switchover time
+      }
+      break;
   }
 }
 
-
 /*******************************/
 /* * * Update group status * * */
 /*******************************/
 
 unsigned long updateGroupsTime = 0;
 
+// Status of a group or a macro computed from the status of its members
+devstatus_t membersStatus(const uint16_t* members, uint16_t count) {
+  devstatus_t stat = devices[members[0]].status;
+  for (int k=1; k < count; k++) {
+    if (devices[members[k]].status != stat) 
+      return DS_MIXED;
+  }
+  return stat;
+}
+
+void setMembersStatus(uint16_t index, devstatus_t stat) {
+  if (devices[index].status != stat) {
+    devices[index].status = stat;
+    if (index == cdev)
+      displayNeedsUpdating = true; 
+    sendToLogPf(LOG_DEBUG, PSTR("Updated status of %s %s to %s"), devicetypes[devices[index].type], devices[index].name, devicestatus[stat]);
+  }  
+}
+
 void updateGroupStatus(void) {
   for (int i=0; i < groupCount; i++) {
-    devstatus_t stat = devices[groups[i].members[0]].status;
-    for (int k=1; k < groups[i].count; k++) {
-      if (devices[groups[i].members[k]].status != stat) {
-        stat = DS_MIXED;
-        break;
-      }
-    }
-    if (devices[groups[i].index].status != stat) {
-      (devices[groups[i].index].status = stat);
-      if (groups[i].index == cdev)
-        displayNeedsUpdating = true; 
-      sendToLogPf(LOG_DEBUG, PSTR("Updated status of group %s to %s"), devices[groups[i].index].name, devicestatus[devices[groups[i].index].status]);
-    }  
+    devstatus_t stat = membersStatus(groups[i].members, groups[i].count);
+    if (acknowledge(groups[i].index, stat, devices[groups[i].index].xstatus))
+      setMembersStatus(groups[i].index, stat);
+  }
+  // macros are unknown to Domoticz, their members are the only source of their status
+  for (int i=0; i < macroCount; i++) {
+    if (macros[i].count)  // 0 if the macro is ignored, see initDevices()
+      setMembersStatus(macros[i].index, membersStatus(macros[i].members, macros[i].count));
   }
 }
 
@@ -502,6 +1495,83 @@ void doUpdateAlertDisplay(void) {
 }
 
 
+/************************/
+/* * * Live dimming * * */
+/************************/
+
+// When config.liveDimRate is not 0, the dim level is sent to Domoticz while 
+// the rotary encoder is turned in BM_DIM_LEVEL mode, but no more than 
+// liveDimRate times per second. Levels reached between two commands are 
+// skipped. The last level is always sent, when the rate limit allows it or 
+// at once when leaving BM_DIM_LEVEL, except when the editing is cancelled 
+// in which case the dimmer is returned to its initial state.
+
+struct {
+  int dev;                // index of the dimmer in devices[]
+  int8_t pending;         // level waiting to be sent, -1 if none
+  int8_t sent;            // last level sent, -1 if none
+  unsigned long lastSend; // time the last level was sent (ms)
+  uint16_t sentCount;     // number of levels sent
+  uint16_t skipped;       // number of levels not sent
+  uint8_t startStatus;    // status of the dimmer when the editing started
+  int8_t startLevel;      // level of the dimmer when the editing started
+} liveDim = {0, -1, -1, 0, 0, 0, DS_OFF, 0};
+
+void startLiveDimming(int dev) {
+  liveDim.dev = dev;
+  liveDim.startStatus = devices[dev].status;
+  liveDim.startLevel = devices[dev].xstatus;
+  liveDim.pending = -1;
+  liveDim.sent = -1;
+  liveDim.sentCount = 0;
+  liveDim.skipped = 0;
+}
+
+void setLiveDimLevel(int8_t level) {
+  if (!config.liveDimRate)
+    return;
+  if (liveDim.pending >= 0)
+    liveDim.skipped++;
+  liveDim.pending = level;
+}
+
+void sendLiveDimLevel(void) {
+  send_domoticz_cmd(liveDim.dev, liveDim.pending * 10, true);  // domoticz dim level 0-100
+  liveDim.sent = liveDim.pending;
+  liveDim.pending = -1;
+  liveDim.lastSend = millis();
+  liveDim.sentCount++;
+}
+
+// To be called in loop()
+void processLiveDimming(void) {
+  if (liveDim.pending >= 0 && millis() - liveDim.lastSend >= 1000/config.liveDimRate)
+    sendLiveDimLevel();
+}
+
+// To be called before leaving BM_DIM_LEVEL without setting the level. 
+// Restores the initial state of the dimmer if levels have been sent.
+void cancelLiveDimming(void) {
+  liveDim.pending = -1;
+  if (liveDim.sent < 0)
+    return;
+  if (liveDim.startStatus == DS_OFF)
+    send_domoticz_cmd(liveDim.dev, 0);
+  else   
+    send_domoticz_cmd(liveDim.dev, liveDim.startLevel * 10, true);
+  sendToLogPf(LOG_DEBUG, PSTR("Live dimming of %s cancelled"), devices[liveDim.dev].name);
+}
+
+// To be called when leaving BM_DIM_LEVEL
+void endLiveDimming(void) {
+  if (liveDim.pending >= 0) 
+    sendLiveDimLevel();
+  if (liveDim.sentCount)
+    sendToLogPf(LOG_DEBUG, PSTR("Live dimming of %s: %u levels sent, %u skipped"), 
+      devices[liveDim.dev].name, liveDim.sentCount, liveDim.skipped);
+}
+
+
 /*******************************************/
 /* * * Rotary encoder with push button * * */
 /*******************************************/
@@ -513,6 +1583,25 @@ void doUpdateAlertDisplay(void) {
 mdRotary rotary = mdRotary(pinClk, pinDt);
 mdPushButton pushButton = mdPushButton(pinSw);  // mdPushButton(pinSw, LOW, true)
 
+// Light sleep only ends on a timer or on a GPIO level. While it is enabled, 
+// each pin of the encoder and of the push button wakes the chip when it 
+// leaves its current level, which is read again before each idle delay.
+void setInputWake(bool enable) {
+  static const uint8_t pins[] = {pinClk, pinDt, pinSw};
+  static bool armed = false;
+  if (!enable && !armed)
+    return;
+  for (uint8_t i = 0; i < sizeof(pins); i++) {
+    if (enable)
+      gpio_pin_wakeup_enable(GPIO_ID_PIN(pins[i]), (digitalRead(pins[i])) ? GPIO_PIN_INTR_LOLEVEL : GPIO_PIN_INTR_HILEVEL);
+    else
+      gpio_pin_intr_state_set(GPIO_ID_PIN(pins[i]), GPIO_PIN_INTR_DISABLE);
+  }
+  if (!enable)
+    gpio_pin_wakeup_disable();
+  armed = enable;
+}
+
 // Set Button mode 
 
 const char* buttonModes[] = {
@@ -529,6 +1618,13 @@ void setButtonMode(buttonMode_t mode) {
     mode = (buttonMode_t) (BM_CONFIGURATION + 1);
   sendToLogPf(LOG_DEBUG, PSTR("Set buttonmode, currently BM_%s, to BM_%s"), buttonModes[buttonMode], buttonModes[mode]);  
   if (buttonMode != mode) {
+    if (mode == BM_BLANKED)
+      wifiDoze();
+    else if (buttonMode == BM_BLANKED)
+      wifiWake();  
+    setInputWake(mode == BM_BLANKED && wifiSleep == WIFI_LIGHT_SLEEP);
+    if (buttonMode == BM_DIM_LEVEL)
+      endLiveDimming();
     if (buttonMode == BM_BLANKED) {
       if (config.defaultDevice < deviceCount)
         cdev = config.defaultDevice;  
@@ -540,13 +1636,14 @@ void setButtonMode(buttonMode_t mode) {
         rotary.setPosition(cdev);
         break;
       case BM_DIM_LEVEL:
+        startLiveDimming(cdev);
         dimLevel = devices[cdev].xstatus;
         rotary.setLimits(10);   // dimLevel 0 - 10
         rotary.setPosition(dimLevel);
         break;
       case BM_SELECTOR:
         selChoice = devices[cdev].status;
-        rotary.setLimits(selectors[devices[cdev].xstatus].statusCount-1);
+        rotary.setLimits(selectors[findSelector(cdev)].statusCount-1);
         rotary.setPosition(selChoice);
         break;
       case BM_BLANKED:
@@ -571,6 +1668,31 @@ void setButtonMode(buttonMode_t mode) {
   }
 }
 
+// Sends the same command to all the members of a macro, one after the other 
+// without waiting for acknowledgements in between. The acknowledgement of 
+// each member is tracked on its own.
+void sendMacro(int dev, int32_t value) {
+  int m = findMacro(dev);
+  if (m < 0) {
+    sendToLogPf(LOG_ERR, PSTR("Macro %s not found in macros[]"), devices[dev].name);
+    return;
+  }
+  unsigned long start = micros();
+  uint16_t sent = 0;
+  for (int k = 0; k < macros[m].count; k++) {
+    int member = macros[m].members[k];
+    devtype_t type = devices[member].type;
+    if (type != DT_SWITCH && type != DT_DIMMER && type != DT_GROUP) {
+      sendToLogPf(LOG_ERR, PSTR("Macro %s: cannot switch %s %s"), devices[dev].name, devicetypes[type], devices[member].name);
+      continue;
+    }
+    send_domoticz_cmd(member, value);
+    sent++;
+  }
+  sendToLogPf(LOG_DEBUG, PSTR("Macro %s: %u commands sent in %u us"), devices[dev].name, sent, (unsigned) (micros() - start));
+  updateGroupStatus();  // show the expected status of the macro at once
+}
+
 void toggleDevice(int dev) {
   if (devices[dev].type <= DT_GROUP && devices[dev].type != DT_SELECTOR && devices[dev].type != DT_CONTACT) {
     send_domoticz_cmd(dev, (devices[dev].status ==  DS_OFF) ? 1 : 0); // Turn device Off if it is on or mixed, on if it is off
@@ -580,6 +1702,8 @@ void toggleDevice(int dev) {
     send_domoticz_cmd(dev, 0);  // push off buttons can only send off messages
   } else if (devices[dev].type == DT_SCENE) {
     send_domoticz_cmd(dev, 1);  // scenes can only be trigerred i.e. turned on
+  } else if (devices[dev].type == DT_MACRO) {
+    sendMacro(dev, (devices[dev].status ==  DS_OFF) ? 1 : 0); // same rule as groups
   } else { 
     sendToLogPf(LOG_ERR, PSTR("Cannot toggle %s a contact switch"), devices[dev].name);
     return;
@@ -588,6 +1712,8 @@ void toggleDevice(int dev) {
 }
 
 void OnButtonClicked(int n) {
+  wifiWake();
+  inputReceived = true;
   sendToLogPf(LOG_DEBUG, PSTR("Button clicked %d times, buttonmode %s (%d), device %s (%d)"), n, buttonModes[buttonMode], buttonMode, devices[cdev].name, cdev);  
 
   if (n < 0) {
@@ -662,12 +1788,16 @@ void OnButtonClicked(int n) {
 
   } else { // buttonmode == BM_DIM_LEVEL || BM_SELECTOR    
     if (n == 1) {
-      if (buttonMode == BM_DIM_LEVEL)
+      if (buttonMode == BM_DIM_LEVEL && config.liveDimRate) {
+        if (liveDim.sent != dimLevel)
+          setLiveDimLevel(dimLevel);  // sent when leaving BM_DIM_LEVEL below
+      } else if (buttonMode == BM_DIM_LEVEL)
         send_domoticz_cmd(cdev, dimLevel * 10, true);  // domoticz dim level 0-100, dimLevel 0-10
       else if (buttonMode == BM_SELECTOR)
         send_domoticz_cmd(cdev, selChoice * 10, true);  // domoticz selectchoice 0, 10, 20 ....
         //; //send_domoticz_cmd(cdev )    
-    }
+    } else if (buttonMode == BM_DIM_LEVEL && config.liveDimRate)
+      cancelLiveDimming();
     // fall through  
   }
 
@@ -684,6 +1814,8 @@ unsigned long lastRotationTime = 0;
 int lastdir = 0;
 
 void ButtonRotated(int32_t position) {
+  wifiWake();
+  inputReceived = true;
   int oldcdev = cdev;
   if (buttonMode == BM_STATUS) {
     if (millis() - lastRotationTime > 300) 
@@ -698,9 +1830,10 @@ void ButtonRotated(int32_t position) {
     }
     lastdir = cdev - oldcdev;
     lastRotationTime = millis();
-  } else if (buttonMode == BM_DIM_LEVEL)
+  } else if (buttonMode == BM_DIM_LEVEL) {
     dimLevel = position;    
-  else if (buttonMode == BM_SELECTOR)
+    setLiveDimLevel(dimLevel);
+  } else if (buttonMode == BM_SELECTOR)
     selChoice = position;  
   else if (buttonMode == BM_CONFIGURATION)
     configChoice = position;   
@@ -713,9 +1846,11 @@ void ButtonRotated(int32_t position) {
 #else 
 
 void ButtonRotated(int32_t position) {
+  wifiWake();
+  inputReceived = true;
   switch(buttonMode) {
     case BM_STATUS:        cdev = position; break;
-    case BM_DIM_LEVEL:     dimLevel = position; break;
+    case BM_DIM_LEVEL:     dimLevel = position; setLiveDimLevel(dimLevel); break;
     case BM_SELECTOR:      selChoice = position; break;
     case BM_CONFIGURATION: configChoice = position; break;
     case BM_BLANKED:       setButtonMode(BM_STATUS); break;
@@ -730,6 +1865,15 @@ void ButtonRotated(int32_t position) {
 /* * * setup * * */
 /*****************/
 
+unsigned long lastBootPhase = 0;
+
+// Logs the time since boot and the time taken by the phase that just ended
+void bootPhase(const char* phase) {
+  unsigned long now = millis();
+  sendToLogPf(LOG_INFO, PSTR("Boot: %S done at %u ms (%u ms)"), phase, (unsigned) now, (unsigned) (now - lastBootPhase));
+  lastBootPhase = now;
+}
+
 void setup() {
   Serial.begin(SERIAL_BAUD);
   Serial.println("\n\nDomoticz Button"); // skip garbage
@@ -754,9 +1898,37 @@ void setup() {
 
   // intialize sound alert (buzzer)
   initBuzzer();
+
+  // build lookup tables of devices
+  initDevices();
+
+  // restore the status of the devices saved in doRestart()
+  uint16_t savedCdev = cdev;
+  int restored = rtcRestoreDevices(&savedCdev);
+  if (restored) {
+    cdev = savedCdev;
+    sendToLogPf(LOG_INFO, PSTR("Restored the status of %d devices saved before restarting"), restored);
+  }
+  bootPhase(PSTR("initialization"));
  
   sendToLogP(LOG_DEBUG, PSTR("Starting Wifi radio"));
   setup_wifi();
+  setWifiSleep(WIFI_NONE_SLEEP);  // the display is on
+  bootPhase(PSTR("Wi-Fi connection"));
+  if (config.mdnsDiscovery) {
+    discoverServers();
+    bootPhase(PSTR("server discovery"));
+  }  
+  // start looking up the servers, the answers arrive in the background and 
+  // the waits for them in setup() share RESOLVER_WAIT 
+  IPAddress ip;
+  resolveHost(config.syslogHost, ip);
+  resolveHost(config.mqttHost, ip);
+  if (config.domoBootstrap)
+    resolveHost(config.domoHost, ip);
+  if (config.autoFirmwareUpdate)
+    resolveHost(config.otaHost, ip);
+  setResolverBudget(RESOLVER_WAIT);
   Show( (char*) SC_WIFI_CONNECTED0,  (char*) WiFi.localIP().toString().c_str(),  (char*) SC_WIFI_CONNECTED2, config.infoTime);
   
   if (config.autoFirmwareUpdate) {
@@ -773,18 +1945,32 @@ void setup() {
       /* continue */
       break;
     }   
+    bootPhase(PSTR("firmware update check"));
   }
 
   // Finish setup of the mqtt clent object.
   sendToLogP(LOG_DEBUG, PSTR("MQTT setup"));
+  initRxFilter();
   if (!mqtt_client.setBufferSize(config.mqttBufferSize))
     sendToLogPf(LOG_ERR, PSTR("Could not allocated %d byte MQTT buffer"), config.mqttBufferSize);
-  sendToLogPf(LOG_DEBUG, PSTR("Setting MQTT server: %s:%d"), config.mqttHost, config.mqttPort);   
-  mqtt_client.setServer(config.mqttHost, config.mqttPort);
   mqtt_client.setCallback(mqttCallback);
-  mqttReconnect();
+  if (config.mqttStreaming)
+    mqtt_client.setStream(domoStream);
+  initMqttConnection();
+  rtcRestoreTlsSession();  // also erases the session if TLS is no longer used
+  if (config.domoBootstrap) {
+    waitForHost(config.domoHost, ip, RESOLVER_WAIT);
+    bootstrapStatus();
+    bootPhase(PSTR("Domoticz HTTP bootstrap"));
+  }
+  waitForHost(config.mqttHost, ip, RESOLVER_WAIT);  // usually answered during the firmware update check
+  mqttConnection();  // first attempt, the status sync continues in loop()
+  bootPhase(PSTR("MQTT connection"));
+  if (mqttConn.state == MS_IDLE) 
+    Show( (char*) SC_MQTT_NOT_CONNECTED0, (char*) SC_MQTT_NOT_CONNECTED1, (char*) SC_MQTT_NOT_CONNECTED2, config.infoTime);
 
   setButtonMode(BM_STATUS);
+  setResolverBudget(0);
 
   sendToLogP(LOG_DEBUG, PSTR("Setup completed"));
 }
@@ -801,11 +1987,9 @@ void setup() {
 unsigned long FAKEopenTime = millis();
 #endif
 
-// Timer to avoid trying to reconnect to the MQTT broker in a tight
-// loop which will prevent processing button presses. Waiting
-// 1 minute between attemps seems reasonable
-#define MQTT_CONNECT_INTERVAL 60000   
-unsigned long lastMqttConnectAttempt = 0;
+// Interval between MQTT receive statistics log messages (10 minutes)
+#define MQTT_STATS_INTERVAL 600000
+unsigned long lastMqttStats = 0;
 
 void loop(void) {
 #ifdef FAKE_OPEN_GARAGE_DOOR
@@ -819,7 +2003,8 @@ void loop(void) {
   pushButton.status();
   minuteTimer();
 
-  if (millis() - updateGroupsTime > 10*1000) {
+  // groups are updated at once while commands are waiting for their acknowledgement
+  if (ackPending() || millis() - updateGroupsTime > 10*1000) {
     updateGroupStatus();
     updateGroupsTime = millis();
   }  
@@ -842,12 +2027,24 @@ void loop(void) {
     }  
   }
   
-  if (!mqtt_client.connected()) {
-   if (millis() - lastMqttConnectAttempt > MQTT_CONNECT_INTERVAL) {
-     lastMqttConnectAttempt = millis();
-      mqttReconnect();
-   }   
-  } else {
-    mqtt_client.loop();
-  }  
+  mqttConnection();
+
+  processRxQueue();
+  checkAcks();
+
+  if (buttonMode == BM_DIM_LEVEL && config.liveDimRate)
+    processLiveDimming();
+
+  if (buttonMode == BM_BLANKED && wifiSleep == WIFI_LIGHT_SLEEP) {
+    setInputWake(true);
+    delay(WIFI_IDLE_DELAY);  // automatic light sleep only starts when idle  
+  }
+
+  if (millis() - lastMqttStats > MQTT_STATS_INTERVAL) {
+    lastMqttStats = millis();
+    logMqttStats();
+    logBrokerStats();
+    logResolverStats();
+    logWakeStats();
+  }
 }  
@@ -0,0 +1,21 @@
+#ifndef MQTTCA_H
+#define MQTTCA_H
+
+#include <Arduino.h>
+
+// Trust anchors used to check the certificate of the MQTT brokers when
+// config.mqttTls is set and config.mqttFingerprint is empty. Paste the PEM
+// certificate of the certificate authority that signed the certificates of
+// the brokers between the BEGIN and END lines, several certificates can
+// follow each other. If the string is empty, config.mqttFingerprint must be
+// set, or config.mqttTls set to 2 to accept any certificate.
+//
+// Since certificates have a validity period, the button needs the current
+// time to check them. It is obtained with NTP from MQTT_NTP_SERVER.
+
+#define MQTT_NTP_SERVER "pool.ntp.org"
+
+static const char mqttCaCert[] PROGMEM = R"EOF(
+)EOF";
+
+#endif
@@ -0,0 +1,216 @@
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+#include <time.h>
+#include <coredecls.h>
+#include "config.h"
+#include "logging.h"
+#include "rtcmem.h"
+#include "resolver.h"
+#include "mqttca.h"
+#include "mqtttls.h"
+
+BearSSL::WiFiClientSecure mqttTlsClient;
+
+// Support of the maximum fragment length extension by a broker
+enum { MFLN_UNKNOWN, MFLN_SUPPORTED, MFLN_UNSUPPORTED };
+
+#define TLS_DEFAULT_TX_SIZE 837         // default transmit buffer size of WiFiClientSecure
+
+static BearSSL::Session sessions[TLS_SESSIONS];
+static uint8_t mfln[TLS_SESSIONS];
+static BearSSL::X509List* trustAnchors = NULL;
+static br_ssl_session_parameters offered;  // session offered in the last attempt
+static volatile bool clockSet = false;     // true once NTP has set the time
+static bool clockWaitLogged = false;
+
+// Broker for which the maximum fragment length extension is to be checked
+static struct {
+  bool pending;
+  uint8_t broker;
+  const char* host;
+  uint16_t port;
+} mflnProbe;
+
+/* * * TLS session in RTC memory * * */
+
+// The session parameters, including the master secret of the session, are 
+// kept in the RTC user memory. They survive resets and restarts but are 
+// lost on power off, and cannot be read from outside the chip. The record 
+// also identifies the TLS configuration it was negotiated with and is 
+// erased at boot if that configuration changed.
+
+typedef struct {
+  uint32_t hostHash;    // identifies the broker 
+  uint32_t configHash;  // identifies the TLS configuration
+  uint8_t broker;       // index of the broker
+  uint8_t mfln;         // MFLN_xxx support of the broker
+  br_ssl_session_parameters session;
+} rtcTls_t;
+
+static_assert((sizeof(rtcTls_t) + 8 + 3)/4 <= RTC_TLS_BLOCKS, "RTC_TLS_BLOCKS too small");
+
+static rtcTls_t restored;
+static bool restoredValid = false;
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME  16777619u
+
+// FNV-1a hash of the host name and port of a broker
+static uint32_t hostHash(const char* host, uint16_t port) {
+  uint32_t h = FNV_OFFSET;
+  while (*host) {
+    h ^= (uint8_t) *host++;
+    h *= FNV_PRIME;
+  }
+  h ^= port;
+  h *= FNV_PRIME;
+  return h;
+}
+
+// FNV-1a hash of the TLS mode, the fingerprint and the trust anchors
+static uint32_t configHash(void) {
+  uint32_t h = FNV_OFFSET;
+  h ^= config.mqttTls;
+  h *= FNV_PRIME;
+  for (const char* p = config.mqttFingerprint; *p; p++) {
+    h ^= (uint8_t) *p;
+    h *= FNV_PRIME;
+  }
+  for (PGM_P p = mqttCaCert; pgm_read_byte(p); p++) {
+    h ^= (uint8_t) pgm_read_byte(p);
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+static void rtcSaveTlsSession(uint8_t n, const char* host, uint16_t port) {
+  rtcTls_t record;
+  record.hostHash = hostHash(host, port);
+  record.configHash = configHash();
+  record.broker = n;
+  record.mfln = mfln[n];
+  record.session = *sessions[n].getSession();
+  if (!rtcWrite(RTC_TLS_BLOCK, RTC_TLS_BLOCKS, RTC_TLS_MAGIC, &record, sizeof(record)))
+    sendToLogP(LOG_ERR, PSTR("Could not save the TLS session in RTC memory"));
+}
+
+void rtcRestoreTlsSession(void) {
+  restoredValid = rtcRead(RTC_TLS_BLOCK, RTC_TLS_MAGIC, &restored, sizeof(restored));
+  if (restoredValid && restored.configHash != configHash()) {
+    rtcErase(RTC_TLS_BLOCK);
+    restoredValid = false;
+    sendToLogP(LOG_INFO, PSTR("TLS configuration changed, the TLS session in RTC memory was erased"));
+  }  
+  if (restoredValid)
+    sendToLogPf(LOG_DEBUG, PSTR("Restored the TLS session of MQTT broker %u from RTC memory"), restored.broker);
+}
+
+/* * * TLS transport * * */
+
+// true if mqttCaCert contains a certificate and not only white space
+static bool hasCaCert(void) {
+  for (PGM_P p = mqttCaCert; pgm_read_byte(p); p++) {
+    if (!isspace(pgm_read_byte(p)))
+      return true;
+  }
+  return false;
+}
+
+// A fingerprint or certificate that is configured but cannot be used does 
+// not fall back to an unchecked connection 
+bool initMqttTls(void) {
+  if (config.mqttTls == 2) {
+    sendToLogP(LOG_WARNING, PSTR("TLS: the certificate of the MQTT broker is not checked (mqttTls 2)"));
+    mqttTlsClient.setInsecure();
+    return true;
+  }
+  if (config.mqttFingerprint[0]) {
+    if (mqttTlsClient.setFingerprint(config.mqttFingerprint)) {
+      sendToLogP(LOG_DEBUG, PSTR("TLS: checking the certificate fingerprint of the MQTT broker"));
+      return true;
+    }  
+    sendToLogPf(LOG_ERR, PSTR("TLS: invalid certificate fingerprint \"%s\", not connecting to the MQTT broker"), config.mqttFingerprint);
+  } else if (hasCaCert()) {
+    trustAnchors = new BearSSL::X509List(mqttCaCert);
+    if (trustAnchors->getCount()) {
+      mqttTlsClient.setTrustAnchors(trustAnchors);
+      settimeofday_cb([]() { clockSet = true; });
+      configTime(0, 0, MQTT_NTP_SERVER);  // certificate validity periods are checked
+      sendToLogPf(LOG_DEBUG, PSTR("TLS: checking the certificate of the MQTT broker with %u trust anchors"), trustAnchors->getCount());
+      return true;
+    }  
+    sendToLogP(LOG_ERR, PSTR("TLS: no valid certificate in mqttca.h, not connecting to the MQTT broker"));
+  } else
+    sendToLogP(LOG_ERR, PSTR("TLS: no fingerprint and no certificate to check the MQTT broker, set mqttTls to 2 to connect without checking it"));
+  return false;
+}
+
+bool mqttTlsClockReady(void) {
+  if (!trustAnchors || clockSet)
+    return true;
+  if (!clockWaitLogged) {
+    sendToLogPf(LOG_INFO, PSTR("TLS: waiting for the time from %s to check the certificate of the MQTT broker"), MQTT_NTP_SERVER);
+    clockWaitLogged = true;
+  }  
+  return false;
+}
+
+bool mqttTlsNeedsHostName(void) {
+  return config.mqttTls == 1 && !config.mqttFingerprint[0];
+}
+
+void prepareMqttTls(uint8_t n, const char* host, uint16_t port) {
+  if (n >= TLS_SESSIONS)
+    return;
+  if (restoredValid && restored.broker == n && restored.hostHash == hostHash(host, port)) {
+    *sessions[n].getSession() = restored.session;
+    mfln[n] = restored.mfln;
+  }
+  restoredValid = false;
+  offered = *sessions[n].getSession();
+  mqttTlsClient.setSession(&sessions[n]);
+  if (mfln[n] == MFLN_SUPPORTED)
+    mqttTlsClient.setBufferSizes(MQTT_TLS_MFLN, MQTT_TLS_MFLN);
+  else  
+    mqttTlsClient.setBufferSizes(BR_SSL_BUFSIZE_INPUT, TLS_DEFAULT_TX_SIZE);
+  if (trustAnchors)
+    mqttTlsClient.setX509Time(time(nullptr));  // set by NTP, see mqttTlsClockReady()
+}
+
+void reportMqttTls(uint8_t n, const char* host, uint16_t port, bool connected, uint32_t time, uint32_t heap) {
+  if (n >= TLS_SESSIONS)
+    return;
+  if (!connected) {
+    char error[64];
+    int code = mqttTlsClient.getLastSSLError(error, sizeof(error));
+    if (code) 
+      sendToLogPf(LOG_ERR, PSTR("TLS: connection to %s failed after %u ms, %s (%d)"), host, (unsigned) time, error, code);
+    return;
+  }
+  const br_ssl_session_parameters& current = *sessions[n].getSession();
+  bool resumed = offered.session_id_len && offered.session_id_len == current.session_id_len && 
+    !memcmp(offered.session_id, current.session_id, current.session_id_len);
+  uint32_t freeHeap = ESP.getFreeHeap();
+  sendToLogPf(LOG_INFO, PSTR("TLS: %s handshake with %s in %u ms, %u bytes of heap used, %u free (largest block %u), %s buffers"),
+    (resumed) ? "resumed" : "full", host, (unsigned) time, (unsigned) ((heap > freeHeap) ? heap - freeHeap : 0), 
+    (unsigned) freeHeap, (unsigned) ESP.getMaxFreeBlockSize(), (mfln[n] == MFLN_SUPPORTED) ? "reduced" : "full size");
+  mflnProbe.pending = (mfln[n] == MFLN_UNKNOWN);
+  mflnProbe.broker = n;
+  mflnProbe.host = host;
+  mflnProbe.port = port;
+  rtcSaveTlsSession(n, host, port);
+}
+
+void probeMqttTls(void) {
+  IPAddress ip;
+  if (!mflnProbe.pending || resolveHost(mflnProbe.host, ip) != HOST_RESOLVED)
+    return;
+  mflnProbe.pending = false;
+  uint8_t n = mflnProbe.broker;
+  uint32_t start = millis();
+  bool supported = BearSSL::WiFiClientSecure::probeMaxFragmentLength(ip, mflnProbe.port, MQTT_TLS_MFLN);
+  mfln[n] = (supported) ? MFLN_SUPPORTED : MFLN_UNSUPPORTED;
+  sendToLogPf(LOG_INFO, PSTR("TLS: %s %s a maximum fragment length of %u bytes (checked in %u ms)"), 
+    mflnProbe.host, (supported) ? "accepts" : "does not accept", MQTT_TLS_MFLN, (unsigned) (millis() - start));
+  rtcSaveTlsSession(n, mflnProbe.host, mflnProbe.port);
+}
@@ -0,0 +1,61 @@
+#ifndef MQTTTLS_H
+#define MQTTTLS_H
+
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+
+/*
+ * TLS transport of the MQTT client
+ *
+ * A full TLS handshake takes seconds on the ESP8266, so the session
+ * negotiated with each broker is kept and offered again on the next
+ * connection, which then only needs an abbreviated handshake. The
+ * session of the last broker connected, including its master secret, is
+ * also saved in the RTC user memory so that it survives a restart. The TLS buffers are reduced
+ * with the maximum fragment length extension when the broker supports
+ * it, which is checked once per broker while the button is not in use.
+ *
+ * With config.mqttTls set to 1, the certificate of the broker must be
+ * checked, either against config.mqttFingerprint or against the trust
+ * anchors in mqttca.h. If neither can be used, no connection is made.
+ * The certificate is only left unchecked with config.mqttTls set to 2.
+ */
+
+#define TLS_SESSIONS 3  // number of brokers for which a session is kept
+
+extern BearSSL::WiFiClientSecure mqttTlsClient;
+
+// Sets up mqttTlsClient from the configuration, to be called once in setup().
+// Returns false if the certificate of the brokers cannot be checked as
+// configured, in which case no connection must be attempted.
+bool initMqttTls(void);
+
+// Returns false while NTP has not set the time, when the certificate of the
+// brokers is checked against the trust anchors, since its validity period
+// cannot be checked. The connection must then be deferred.
+bool mqttTlsClockReady(void);
+
+// true if the certificate of the brokers is checked against the trust anchors,
+// which needs their host name rather than their IP address
+bool mqttTlsNeedsHostName(void);
+
+// To be called before connecting to broker n, the index of the broker in
+// the list of brokers
+void prepareMqttTls(uint8_t n, const char* host, uint16_t port);
+
+// To be called after each attempt to connect to broker n. Logs the time taken
+// and the heap used, and whether the session was resumed. The heap parameter
+// is the free heap before the attempt.
+void reportMqttTls(uint8_t n, const char* host, uint16_t port, bool connected, uint32_t time, uint32_t heap);
+
+// Checks whether the broker last connected supports the maximum fragment
+// length extension if that is not known yet, so that the next connections
+// use smaller buffers. The check blocks for a partial handshake, to be
+// called while the button is not in use.
+void probeMqttTls(void);
+
+// Restores the session saved in the RTC user memory after a restart, or
+// erases it if the TLS configuration changed since it was saved
+void rtcRestoreTlsSession(void);
+
+#endif
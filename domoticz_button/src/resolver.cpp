@@ -0,0 +1,210 @@
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <lwip/dns.h>
+#include "config.h"
+#include "logging.h"
+#include "resolver.h"
+
+enum {
+  HE_EMPTY,     // unused entry
+  HE_LITERAL,   // the host is an IP address
+  HE_PENDING,   // first lookup in progress
+  HE_VALID,     // address known
+  HE_FAILED     // last lookup failed, no known address
+};
+
+typedef struct {
+  char host[URL_SZ];
+  IPAddress address;
+  volatile uint8_t state;     // HE_xxx
+  volatile bool refreshing;   // lookup in progress for a HE_VALID entry
+  volatile bool answered;     // the lookup in progress got its answer
+  volatile bool found;        // the answer contained an address
+  IPAddress answer;           // address obtained by the lookup in progress
+  uint32_t expires;           // millis() when the address or the failure expires
+  uint32_t started;           // millis() when the lookup in progress started
+  uint32_t lastUse;           // millis() of the last resolveHost() for this host
+  uint32_t hits;              // resolveHost() calls answered from the cache
+  uint16_t lookups;           // lookups started
+  uint16_t failures;          // lookups that failed or timed out
+  uint16_t lookupTime;        // duration of the last lookup (ms)
+} hostEntry_t;
+
+static hostEntry_t cache[RESOLVER_SLOTS];
+
+static uint32_t budget = 0;       // ms, 0 if waitForHost() is not limited
+static uint32_t budgetStart;
+
+// Called by lwIP when the answer arrives, outside of loop(). Only records
+// the answer which is handled by the next resolveHost() call.
+static void dnsFound(const char* name, const ip_addr_t* ipaddr, void* arg) {
+  hostEntry_t& entry = cache[(uintptr_t) arg];
+  if ((entry.state != HE_PENDING && !entry.refreshing) || strcmp(name, entry.host))
+    return;  // the entry was reused for another host
+  if (ipaddr) 
+    entry.answer = IPAddress(ipaddr);
+  entry.found = (ipaddr != NULL);
+  entry.answered = true;
+}
+
+static void startLookup(uint8_t n) {
+  hostEntry_t& entry = cache[n];
+  if (WiFi.status() != WL_CONNECTED)
+    return;  // tried again on the next call
+  ip_addr_t addr;
+  entry.answered = false;
+  entry.started = millis();
+  entry.lookups++;
+  if (entry.state == HE_VALID)
+    entry.refreshing = true;
+  else
+    entry.state = HE_PENDING;   
+  err_t err = dns_gethostbyname(entry.host, &addr, dnsFound, (void*) (uintptr_t) n);
+  if (err == ERR_OK) {
+    // in the lwIP table 
+    entry.answer = IPAddress(&addr);
+    entry.found = true;
+    entry.answered = true;
+  } else if (err != ERR_INPROGRESS) {
+    entry.found = false;
+    entry.answered = true;
+  }
+}
+
+// Takes into account the answer received or the timeout of the lookup in progress
+static void endLookup(hostEntry_t& entry) {
+  uint32_t now = millis();
+  if (!entry.answered) {
+    if (now - entry.started < RESOLVER_TIMEOUT)
+      return;
+    entry.found = false;  
+  }
+  entry.lookupTime = (now - entry.started > 0xFFFF) ? 0xFFFF : now - entry.started;
+  if (entry.found) {
+    entry.address = entry.answer;
+    entry.state = HE_VALID;
+    entry.expires = now + RESOLVER_TTL;
+  } else {
+    entry.failures++;
+    if (entry.state == HE_VALID) {
+      entry.expires = now + RESOLVER_NEGATIVE_TTL;  // keep the old address for now 
+    } else {
+      entry.state = HE_FAILED;
+      entry.expires = now + RESOLVER_NEGATIVE_TTL;
+    }
+  }
+  entry.refreshing = false;
+  entry.answered = false;
+}
+
+static uint8_t findEntry(const char* host) {
+  for (uint8_t n = 0; n < RESOLVER_SLOTS; n++) {
+    if (cache[n].state != HE_EMPTY && !strcmp(cache[n].host, host))
+      return n;
+  }
+  // not found, use an empty entry or the least recently used one
+  uint8_t n = 0;
+  for (uint8_t k = 0; k < RESOLVER_SLOTS; k++) {
+    if (cache[k].state == HE_EMPTY) {
+      n = k;
+      break;
+    }
+    if (millis() - cache[k].lastUse > millis() - cache[n].lastUse)
+      n = k;
+  }
+  hostEntry_t& entry = cache[n];
+  entry.state = HE_EMPTY;
+  entry.refreshing = false;
+  entry.answered = false;
+  entry.hits = entry.lookups = entry.failures = entry.lookupTime = 0;
+  strlcpy(entry.host, host, sizeof(entry.host));
+  if (entry.address.fromString(host)) {
+    entry.state = HE_LITERAL;
+  } else {
+    entry.state = HE_FAILED;  // expired failure, the lookup starts at once
+    entry.expires = millis();
+  }  
+  return n;
+}
+
+hostStatus_t resolveHost(const char* host, IPAddress& ip) {
+  if (!host[0])
+    return HOST_UNKNOWN;
+  uint8_t n = findEntry(host);
+  hostEntry_t& entry = cache[n];
+  entry.lastUse = millis();
+  if (entry.state == HE_PENDING || entry.refreshing)
+    endLookup(entry);
+  if ((entry.state == HE_VALID && !entry.refreshing) || entry.state == HE_FAILED) {
+    if ((int32_t) (millis() - entry.expires) >= 0)
+      startLookup(n);
+    if (entry.answered)  
+      endLookup(entry);  // answered at once
+  }
+  switch (entry.state) {
+    case HE_LITERAL:
+    case HE_VALID:
+      ip = entry.address;
+      entry.hits++;
+      return HOST_RESOLVED;
+    case HE_FAILED:
+      return ((int32_t) (millis() - entry.expires) >= 0) ? HOST_PENDING : HOST_UNKNOWN; 
+    default:
+      return HOST_PENDING;
+  }
+}
+
+hostStatus_t refreshHost(const char* host, IPAddress& ip) {
+  if (!host[0])
+    return HOST_UNKNOWN;
+  uint8_t n = findEntry(host);
+  hostEntry_t& entry = cache[n];
+  entry.lastUse = millis();
+  if (entry.state == HE_LITERAL) {
+    ip = entry.address;
+    return HOST_RESOLVED;
+  }  
+  if (entry.state == HE_PENDING || entry.refreshing) {
+    endLookup(entry);
+    if (entry.state == HE_PENDING || entry.refreshing)
+      return HOST_PENDING;
+  } else {
+    startLookup(n);
+    if (!entry.answered)
+      return HOST_PENDING;
+    endLookup(entry);  // answered at once from the lwIP table
+  }
+  if (!entry.found)
+    return HOST_UNKNOWN;
+  ip = entry.address;
+  return HOST_RESOLVED;
+}
+
+hostStatus_t waitForHost(const char* host, IPAddress& ip, uint32_t timeout) {
+  uint32_t start = millis();
+  if (budget) {
+    uint32_t left = (start - budgetStart < budget) ? budget - (start - budgetStart) : 0;
+    if (timeout > left)
+      timeout = left;
+  }
+  hostStatus_t status;
+  while ((status = resolveHost(host, ip)) == HOST_PENDING && millis() - start < timeout)
+    delay(10);
+  return status;
+}
+
+void setResolverBudget(uint32_t ms) {
+  budget = ms;
+  budgetStart = millis();
+}
+
+void logResolverStats(void) {
+  for (uint8_t n = 0; n < RESOLVER_SLOTS; n++) {
+    hostEntry_t& entry = cache[n];
+    if (entry.state == HE_EMPTY || entry.state == HE_LITERAL)
+      continue;
+    sendToLogPf(LOG_INFO, PSTR("DNS %s: %s, %u hits, %u lookups, %u failed, last lookup %u ms"), entry.host, 
+      (entry.state == HE_VALID) ? entry.address.toString().c_str() : (entry.state == HE_PENDING) ? "pending" : "not found",
+      (unsigned) entry.hits, entry.lookups, entry.failures, entry.lookupTime);
+  }
+}
@@ -0,0 +1,53 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <Arduino.h>
+
+/*
+ * Cache of the addresses of the servers used by the button
+ *
+ * The syslog, MQTT, OTA and Domoticz hosts are resolved once in the 
+ * background with the lwIP asynchronous DNS client and their address is 
+ * kept for RESOLVER_TTL ms. Once that time has elapsed, the cached address 
+ * is still used while a new lookup is done. A failed lookup is not retried
+ * for RESOLVER_NEGATIVE_TTL ms. resolveHost() never waits for the DNS 
+ * server and must not log anything since it is used by sendToLog().
+ */
+
+#define RESOLVER_SLOTS          6  // number of hosts in the cache
+#define RESOLVER_TTL       600000  // ms, time an address is considered valid
+#define RESOLVER_NEGATIVE_TTL 30000  // ms, delay before retrying a failed lookup
+#define RESOLVER_TIMEOUT    20000  // ms, a lookup without an answer is abandoned
+#define RESOLVER_WAIT        5000  // ms, longest wait of waitForHost() for HTTP requests, and in all during setup()
+
+enum hostStatus_t {
+  HOST_RESOLVED,  // the address is known
+  HOST_PENDING,   // the lookup is in progress or cannot start yet (no Wi-Fi)
+  HOST_UNKNOWN    // the lookup failed recently
+};
+
+// Returns the address of host, which can also be an IP address, in ip if 
+// it is in the cache. Otherwise starts the lookup and returns HOST_PENDING.
+hostStatus_t resolveHost(const char* host, IPAddress& ip);
+
+// Looks host up again with lwIP, without waiting, so that the name is in the 
+// lwIP table when a library resolves it itself with WiFi.hostByName(), which 
+// then does not block. Returns HOST_PENDING until the answer is received and 
+// HOST_RESOLVED, with the address in ip, once the name is in the table. 
+hostStatus_t refreshHost(const char* host, IPAddress& ip);
+
+// Same as resolveHost() but waits up to timeout ms for the answer. Only for
+// code that blocks on the network anyway, such as the firmware update.
+// The wait is also limited by the budget set with setResolverBudget().
+hostStatus_t waitForHost(const char* host, IPAddress& ip, uint32_t timeout);
+
+// Limits the total time that the following waitForHost() calls can wait 
+// to budget ms from now, 0 to remove the limit. The lookups of all the hosts 
+// needed at boot are started together, so that a DNS server that does not 
+// answer delays the boot by budget ms at most, whatever the number of hosts.
+void setResolverBudget(uint32_t budget);
+
+// Logs the content of the cache and the lookup statistics
+void logResolverStats(void);
+
+#endif
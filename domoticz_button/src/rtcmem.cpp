@@ -0,0 +1,136 @@
+#include <Arduino.h>
+#include "logging.h"
+#include "devices.h"
+#include "rtcmem.h"
+
+typedef struct {
+  uint16_t magic;
+  uint16_t size;   // size of the data in bytes
+  uint32_t crc;    // CRC-32 of the data
+} rtcHeader_t;
+
+#define RTC_BUFFER_SIZE  ((RTC_BLOCK_COUNT - 1)*4)  // largest record
+
+// Header and data of the record being read or written, static since it is
+// too large for the stack of loop(). rtcRead() and rtcWrite() are never 
+// called from an interrupt or a callback, so they are not reentered.
+static uint32_t buffer[(RTC_BUFFER_SIZE + sizeof(rtcHeader_t))/4];
+
+static uint32_t crc32(const uint8_t* data, size_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  while (length--) {
+    crc ^= *data++;
+    for (int k = 0; k < 8; k++)
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
+
+bool rtcWrite(uint32_t block, uint32_t maxBlocks, uint16_t magic, const void* data, uint16_t size) {
+  uint32_t blocks = (sizeof(rtcHeader_t) + size + 3)/4;
+  if (blocks > maxBlocks || block + blocks > RTC_FIRST_BLOCK + RTC_BLOCK_COUNT)
+    return false;
+  rtcHeader_t header = {magic, size, crc32((const uint8_t*) data, size)};  
+  // rtcUserMemoryWrite() needs a multiple of 4 bytes 
+  memcpy(buffer, &header, sizeof(header));
+  memcpy((uint8_t*) buffer + sizeof(header), data, size);
+  return ESP.rtcUserMemoryWrite(block, buffer, blocks*4);
+}
+
+bool rtcRead(uint32_t block, uint16_t magic, void* data, uint16_t size) {
+  rtcHeader_t header;
+  if (!ESP.rtcUserMemoryRead(block, (uint32_t*) &header, sizeof(header)))
+    return false;
+  if (header.magic != magic || header.size != size || size > RTC_BUFFER_SIZE)
+    return false;
+  uint32_t blocks = (sizeof(rtcHeader_t) + size + 3)/4;
+  if (!ESP.rtcUserMemoryRead(block, buffer, blocks*4))
+    return false;
+  if (crc32((uint8_t*) buffer + sizeof(header), size) != header.crc)
+    return false;
+  memcpy(data, (uint8_t*) buffer + sizeof(header), size);
+  return true;
+}
+
+void rtcErase(uint32_t block) {
+  rtcHeader_t header = {0, 0, 0};
+  ESP.rtcUserMemoryWrite(block, (uint32_t*) &header, sizeof(header));
+}
+
+/* * * Device status snapshot * * */
+
+// The extra status of devices is a dim level 0..10 or 0, one byte 
+// is enough for it and the status, see RTC_MAX_DEVICES
+
+typedef struct {
+  uint32_t devicesHash;  // identifies the devices[] table
+  uint16_t count;
+  uint16_t cdev;
+  struct {
+    uint8_t status;
+    int8_t xstatus;
+  } state[RTC_MAX_DEVICES];  
+} rtcDevices_t;
+
+// FNV-1a hash of the idx and type of all devices
+static uint32_t devicesHash(void) {
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < deviceCount; i++) {
+    uint32_t key = (devices[i].idx << 3) | devices[i].type;
+    for (int k = 0; k < 4; k++) {
+      h ^= (key >> (8*k)) & 0xFF;
+      h *= 16777619u;
+    }
+  }
+  return h;
+}
+
+// true if devices[] is too large for the snapshot, logged once 
+static bool tooManyDevices(void) {
+  static bool logged = false;
+  if (deviceCount <= RTC_MAX_DEVICES)
+    return false;
+  if (!logged) {
+    sendToLogPf(LOG_WARNING, PSTR("%d devices, the status of more than %d cannot be kept in RTC memory across restarts"), 
+      deviceCount, RTC_MAX_DEVICES);
+    logged = true;
+  }  
+  return true;
+}
+
+bool rtcSaveDevices(uint16_t cdev) {
+  if (tooManyDevices())
+    return false;
+  rtcDevices_t snapshot;
+  snapshot.devicesHash = devicesHash();
+  snapshot.count = deviceCount;
+  snapshot.cdev = cdev;
+  for (int i = 0; i < deviceCount; i++) {
+    snapshot.state[i].status = devices[i].status;
+    snapshot.state[i].xstatus = devices[i].xstatus;
+  }  
+  uint16_t size = offsetof(rtcDevices_t, state) + deviceCount*sizeof(snapshot.state[0]);
+  return rtcWrite(RTC_DEVICES_BLOCK, RTC_DEVICES_BLOCKS, RTC_DEVICES_MAGIC, &snapshot, size);
+}
+
+int rtcRestoreDevices(uint16_t* cdev) {
+  if (tooManyDevices()) 
+    return 0;
+  rtcDevices_t snapshot;
+  uint16_t size = offsetof(rtcDevices_t, state) + deviceCount*sizeof(snapshot.state[0]);
+  if (!rtcRead(RTC_DEVICES_BLOCK, RTC_DEVICES_MAGIC, &snapshot, size)) 
+    return 0;
+  rtcErase(RTC_DEVICES_BLOCK);  // only restore once  
+  if (snapshot.count != deviceCount || snapshot.devicesHash != devicesHash()) {
+    sendToLogP(LOG_INFO, PSTR("Device status snapshot in RTC memory is for other devices, ignored"));
+    return 0;
+  }  
+  for (int i = 0; i < deviceCount; i++) {
+    devices[i].status = (devstatus_t) snapshot.state[i].status;
+    devices[i].xstatus = snapshot.state[i].xstatus;
+    devices[i].sync = SS_STALE;
+  }
+  if (snapshot.cdev < deviceCount)
+    *cdev = snapshot.cdev;
+  return deviceCount;  
+}
@@ -0,0 +1,63 @@
+#ifndef RTCMEM_H
+#define RTCMEM_H
+
+#include <Arduino.h>
+
+/*
+ * Data kept in the RTC user memory across software restarts
+ *
+ * The RTC user memory (512 bytes) survives ESP.restart() and deep sleep
+ * but not a power cycle. It is addressed in 4 byte blocks and the first 
+ * 32 blocks (128 bytes) are used by the OTA firmware update, so the 
+ * application has 96 blocks (384 bytes) starting at block 32. Each 
+ * record is preceded by a header with a magic number, its size and a 
+ * CRC so that stale or random content is never restored.
+ */
+
+#define RTC_FIRST_BLOCK    32
+#define RTC_BLOCK_COUNT    96
+
+// Map of the RTC user memory records (block offsets and maximum size in blocks including the header)
+#define RTC_DEVICES_BLOCK  RTC_FIRST_BLOCK    // device status snapshot
+#define RTC_DEVICES_BLOCKS 48
+#define RTC_TLS_BLOCK      (RTC_DEVICES_BLOCK + RTC_DEVICES_BLOCKS)  // TLS session of the MQTT broker, see mqtttls.cpp
+#define RTC_TLS_BLOCKS     26
+#define RTC_DISCOVERY_BLOCK (RTC_TLS_BLOCK + RTC_TLS_BLOCKS)  // servers found by mDNS, see discovery.cpp
+#define RTC_DISCOVERY_BLOCKS 8
+#define RTC_WIFI_BLOCK     (RTC_DISCOVERY_BLOCK + RTC_DISCOVERY_BLOCKS)  // access point and IP lease, see wififast.cpp
+#define RTC_WIFI_BLOCKS    9
+
+// Magic number of each record, two ASCII characters, the first one in the 
+// high byte. Each record has its own so that a record is never read as 
+// another one.
+#define RTC_DEVICES_MAGIC   0x4456  // 'D','V'
+#define RTC_TLS_MAGIC       0x544C  // 'T','L'
+#define RTC_DISCOVERY_MAGIC 0x5344  // 'S','D'
+#define RTC_WIFI_MAGIC      0x4657  // 'F','W'
+
+// Writes size bytes of data as a record at the given block, maxBlocks is
+// the space reserved for the record. Returns false if it does not fit.
+bool rtcWrite(uint32_t block, uint32_t maxBlocks, uint16_t magic, const void* data, uint16_t size);
+
+// Reads the record at the given block into data. Returns false if there
+// is no valid record with the given magic number and size.
+bool rtcRead(uint32_t block, uint16_t magic, void* data, uint16_t size);
+
+// Invalidates the record at the given block
+void rtcErase(uint32_t block);
+
+// Largest number of devices whose status fits in the snapshot, one byte for 
+// the status and one for the extra status of each device after a 8 byte 
+// header. With more devices than that in devices[], no snapshot is made and 
+// the status of all devices is obtained from Domoticz after a restart.
+#define RTC_MAX_DEVICES  (((RTC_DEVICES_BLOCKS - 1)*4 - 8)/2)   // 90
+
+// Saves the status and extra status of all devices and the current device 
+bool rtcSaveDevices(uint16_t cdev);
+
+// Restores the snapshot saved by rtcSaveDevices() if it is valid and was 
+// made with the same devices[] table. Restored devices are marked SS_STALE 
+// and the snapshot is erased. Returns the number of devices restored.
+int rtcRestoreDevices(uint16_t* cdev);
+
+#endif
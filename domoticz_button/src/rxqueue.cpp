@@ -0,0 +1,47 @@
+#include <Arduino.h>
+#include "rxqueue.h"
+
+static rxrecord_t queue[RX_QUEUE_SIZE];
+static uint16_t head = 0;   // index of the oldest record
+static uint16_t count = 0;  // number of pending records
+
+rxQueueStats_t rxQueueStats = {0, 0, 0, 0};
+
+bool rxPush(const rxrecord_t& rec) {
+  for (uint16_t n = 0; n < count; n++) {
+    rxrecord_t* pending = &queue[(head + n) % RX_QUEUE_SIZE];
+    if (pending->index == rec.index) {
+      *pending = rec;
+      rxQueueStats.coalesced++;
+      return true;
+    }
+  }
+  if (count >= RX_QUEUE_SIZE) {
+    rxQueueStats.dropped++;
+    return false;
+  }
+  queue[(head + count) % RX_QUEUE_SIZE] = rec;
+  count++;
+  rxQueueStats.pushed++;
+  if (count > rxQueueStats.highWater) 
+    rxQueueStats.highWater = count;
+  return true;
+}
+
+bool rxPop(rxrecord_t& rec) {
+  if (!count) 
+    return false;
+  rec = queue[head];
+  head = (head + 1) % RX_QUEUE_SIZE;
+  count--;
+  return true;
+}
+
+uint16_t rxPending(void) {
+  return count;
+}
+
+void rxClear(void) {
+  head = 0;
+  count = 0;
+}
@@ -0,0 +1,47 @@
+#ifndef RXQUEUE_H
+#define RXQUEUE_H
+
+#include <Arduino.h>
+
+/*
+ * Bounded ingress queue of device status updates
+ *
+ * The MQTT callback decodes each Domoticz message into a compact record
+ * which is pushed in this fixed size ring buffer. The records are applied
+ * to devices[] later in loop() within a time budget so that a burst of 
+ * messages does not prevent the rotary encoder and the push button from
+ * being polled. Nothing is allocated on the heap.
+ */
+
+#define RX_QUEUE_SIZE 16  // maximum number of pending records
+
+typedef struct {
+  uint16_t index;   // index of the device in devices[]
+  uint8_t status;   // new devstatus_t of the device
+  int16_t xstatus;  // new extra status of the device
+} rxrecord_t;
+
+typedef struct {
+  uint32_t pushed;     // records pushed in the queue
+  uint32_t coalesced;  // records that replaced a pending record for the same device
+  uint32_t dropped;    // records dropped because the queue was full
+  uint16_t highWater;  // largest number of pending records
+} rxQueueStats_t;
+
+extern rxQueueStats_t rxQueueStats;
+
+// Adds a record at the end of the queue. If a record for the same device
+// is already pending, it is replaced since only the latest status matters.
+// Returns false if the record was dropped because the queue is full.
+bool rxPush(const rxrecord_t& rec);
+
+// Removes the oldest record from the queue. Returns false if the queue is empty.
+bool rxPop(rxrecord_t& rec);
+
+// Number of pending records
+uint16_t rxPending(void);
+
+// Discards all pending records
+void rxClear(void);
+
+#endif
@@ -11,6 +11,8 @@
 #include "config.h"
 #include "logging.h"
 #include "sota.h"
+#include "resolver.h"
+#include "discovery.h"
 
 WiFiClient wifiClient;
 
@@ -33,7 +35,12 @@ bool otaUpdate(void) {
   String mac = config.hostname;
   #endif
   String url = String(config.otaUrlBase) + mac + ".bin";
-  t_httpUpdate_return ret = ESPhttpUpdate.update(wifiClient, config.otaHost, config.otaPort, url);
+  IPAddress otaIp;
+  if (waitForHost(config.otaHost, otaIp, RESOLVER_WAIT) != HOST_RESOLVED) {
+    sendToLogPf(LOG_ERR, PSTR("Firmware update failed, could not resolve %s"), config.otaHost);
+    return false;
+  }
+  t_httpUpdate_return ret = ESPhttpUpdate.update(wifiClient, otaIp.toString(), config.otaPort, url);
   switch (ret) {
     case HTTP_UPDATE_FAILED:
       sendToLogPf(LOG_ERR, PSTR("Firmware update failed with error (%d): %s"), ESPhttpUpdate.getLastError(), ESPhttpUpdate.getLastErrorString().c_str());
@@ -56,7 +63,12 @@ OTA_result_t checkForUpdates(void) {
   #else
   String mac = config.hostname;
   #endif
-  String versionURL = String("http://") + config.otaHost + ':' + config.otaPort + config.otaUrlBase + mac + ".version";
+  IPAddress otaIp;
+  if (waitForHost(config.otaHost, otaIp, RESOLVER_WAIT) != HOST_RESOLVED) {
+    sendToLogPf(LOG_INFO, PSTR("Firmware version check failed, could not resolve %s"), config.otaHost);
+    return OTA_FAILED;
+  }
+  String versionURL = String("http://") + otaIp.toString() + ':' + config.otaPort + config.otaUrlBase + mac + ".version";
 
   HTTPClient httpClient;
   httpClient.begin(wifiClient, versionURL);
@@ -65,6 +77,8 @@ OTA_result_t checkForUpdates(void) {
     sendToLogPf(LOG_INFO, PSTR("%s.%s not found on OTA server"), mac.c_str(), "version");
   } else if (httpCode != 200) {
     sendToLogPf(LOG_INFO, PSTR("Firmware version check failed. HTTP response code %d"), httpCode);
+    if (httpCode < 0)
+      rediscoverServer(SRV_OTA);  // for the next check
   } else {
     String newFWVersion = httpClient.getString();
     int newVersion = newFWVersion.toInt();
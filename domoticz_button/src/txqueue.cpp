@@ -0,0 +1,54 @@
+#include <Arduino.h>
+#include "txqueue.h"
+
+static txrecord_t queue[TX_QUEUE_SIZE];
+static uint16_t head = 0;   // index of the oldest command
+static uint16_t count = 0;  // number of pending commands
+
+txQueueStats_t txQueueStats = {0, 0, 0, 0, 0};
+
+bool txPush(const txrecord_t& rec) {
+  bool result = true;
+  for (uint16_t n = 0; n < count; n++) {
+    if (queue[(head + n) % TX_QUEUE_SIZE].index == rec.index) {
+      // remove the pending command, keeping the order of the others 
+      for (uint16_t k = n; k + 1 < count; k++) 
+        queue[(head + k) % TX_QUEUE_SIZE] = queue[(head + k + 1) % TX_QUEUE_SIZE];
+      count--;
+      txQueueStats.collapsed++;
+      break;
+    }
+  }
+  if (count >= TX_QUEUE_SIZE) {
+    txPop();
+    txQueueStats.dropped++;
+    result = false;
+  }
+  queue[(head + count) % TX_QUEUE_SIZE] = rec;
+  count++;
+  txQueueStats.queued++;
+  return result;
+}
+
+bool txPeek(txrecord_t& rec) {
+  if (!count) 
+    return false;
+  rec = queue[head];
+  return true;
+}
+
+void txPop(void) {
+  if (!count) 
+    return;
+  head = (head + 1) % TX_QUEUE_SIZE;
+  count--;
+}
+
+uint16_t txPending(void) {
+  return count;
+}
+
+void txClear(void) {
+  head = 0;
+  count = 0;
+}
@@ -0,0 +1,54 @@
+#ifndef TXQUEUE_H
+#define TXQUEUE_H
+
+#include <Arduino.h>
+
+/*
+ * Bounded queue of outgoing commands
+ *
+ * Commands to Domoticz that cannot be published because the MQTT
+ * client is not connected are held in this fixed size ring buffer 
+ * and published in order once the connection is restored. A new 
+ * command for a device replaces any pending command for the same 
+ * device and moves to the end of the queue. When the queue is full, 
+ * the oldest command is dropped. Nothing is allocated on the heap.
+ */
+
+#define TX_QUEUE_SIZE 8  // maximum number of pending commands
+
+typedef struct {
+  uint16_t index;   // index of the device in devices[]
+  bool isLevel;     // value is a level, see send_domoticz_cmd()
+  int32_t value;    // new value of the device
+  uint32_t time;    // millis() when the command was made
+} txrecord_t;
+
+typedef struct {
+  uint32_t queued;     // commands pushed in the queue
+  uint32_t collapsed;  // commands that replaced a pending command for the same device
+  uint32_t dropped;    // commands dropped because the queue was full
+  uint32_t expired;    // commands dropped because they were too old when replayed
+  uint32_t replayed;   // commands published from the queue
+} txQueueStats_t;
+
+extern txQueueStats_t txQueueStats;
+
+// Adds a command at the end of the queue, removing any pending command
+// for the same device. Returns false if the oldest command was dropped
+// to make room.
+bool txPush(const txrecord_t& rec);
+
+// Copies the oldest command into rec without removing it. Returns false 
+// if the queue is empty.
+bool txPeek(txrecord_t& rec);
+
+// Removes the oldest command from the queue
+void txPop(void);
+
+// Number of pending commands
+uint16_t txPending(void);
+
+// Discards all pending commands
+void txClear(void);
+
+#endif
@@ -0,0 +1,90 @@
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include "config.h"
+#include "logging.h"
+#include "rtcmem.h"
+#include "wififast.h"
+
+typedef struct {
+  uint8_t bssid[6];  // MAC address of the access point
+  uint8_t channel;
+  uint8_t reserved;
+  uint32_t ip;       // DHCP lease
+  uint32_t gateway;
+  uint32_t mask;
+  uint32_t dns;
+  uint32_t reused;   // time the address has been used without DHCP (s)
+} rtcWifi_t;
+
+static_assert((sizeof(rtcWifi_t) + 8 + 3)/4 <= RTC_WIFI_BLOCKS, "RTC_WIFI_BLOCKS too small");
+static_assert(RTC_WIFI_BLOCK + RTC_WIFI_BLOCKS <= RTC_FIRST_BLOCK + RTC_BLOCK_COUNT, "RTC user memory full");
+
+static bool staticLease = false;  // true while the address saved before the restart is used
+static uint32_t reusedAtBoot;     // time it had been used before this boot (s)
+
+bool fastWifiConnect(void) {
+  rtcWifi_t saved;
+  if (!config.wifiFastConnect || !rtcRead(RTC_WIFI_BLOCK, RTC_WIFI_MAGIC, &saved, sizeof(saved)))
+    return false;
+  // credentials saved by the SDK when WiFiManager last connected   
+  String ssid = WiFi.SSID();
+  String psk = WiFi.psk();
+  if (!ssid.length())
+    return false;
+  uint32_t start = millis();
+  bool staticIp = config.wifiFastConnect > 1 && saved.ip && saved.reused < WIFI_LEASE_REUSE_MAX;
+  if (config.wifiFastConnect > 1 && saved.ip && !staticIp)
+    sendToLogPf(LOG_INFO, PSTR("IP address used for %u s without DHCP, getting a new lease"), (unsigned) saved.reused);
+  WiFi.persistent(false);  // the credentials are already in flash
+  WiFi.mode(WIFI_STA);
+  if (staticIp)
+    WiFi.config(IPAddress(saved.ip), IPAddress(saved.gateway), IPAddress(saved.mask), IPAddress(saved.dns));
+  WiFi.begin(ssid.c_str(), psk.c_str(), saved.channel, saved.bssid, true);
+  while (WiFi.status() != WL_CONNECTED && millis() - start < WIFI_FAST_TIMEOUT) 
+    delay(5);
+  WiFi.persistent(true);  
+  if (WiFi.status() == WL_CONNECTED) {
+    sendToLogPf(LOG_INFO, PSTR("Wi-Fi connected to %s on channel %u in %u ms%s"), ssid.c_str(), saved.channel, 
+      (unsigned) (millis() - start), (staticIp) ? " with the previous IP address" : "");
+    staticLease = staticIp;
+    reusedAtBoot = saved.reused;
+    if (!staticIp)
+      saveWifiConnection();  // new lease
+    return true;
+  }
+  sendToLogPf(LOG_ERR, PSTR("Fast Wi-Fi connection to %s on channel %u failed after %u ms"), ssid.c_str(), saved.channel, (unsigned) (millis() - start));
+  rtcErase(RTC_WIFI_BLOCK);
+  if (staticIp) 
+    WiFi.config(IPAddress(), IPAddress(), IPAddress());  // back to DHCP
+  WiFi.disconnect();
+  return false;
+}
+
+void saveWifiConnection(void) {
+  if (!config.wifiFastConnect || WiFi.status() != WL_CONNECTED)
+    return;
+  rtcWifi_t current;
+  memcpy(current.bssid, WiFi.BSSID(), sizeof(current.bssid));
+  current.channel = WiFi.channel();
+  current.reserved = 0;
+  current.ip = WiFi.localIP();
+  current.gateway = WiFi.gatewayIP();
+  current.mask = WiFi.subnetMask();
+  current.dns = WiFi.dnsIP();
+  current.reused = 0;
+  rtcWrite(RTC_WIFI_BLOCK, RTC_WIFI_BLOCKS, RTC_WIFI_MAGIC, &current, sizeof(current));
+}
+
+void checkWifiLease(void) {
+  rtcWifi_t saved;
+  if (!staticLease || !rtcRead(RTC_WIFI_BLOCK, RTC_WIFI_MAGIC, &saved, sizeof(saved)))
+    return;
+  saved.reused = reusedAtBoot + millis()/1000;
+  rtcWrite(RTC_WIFI_BLOCK, RTC_WIFI_BLOCKS, RTC_WIFI_MAGIC, &saved, sizeof(saved));
+  if (saved.reused < WIFI_LEASE_REUSE_MAX)
+    return;
+  // the DHCP server usually hands out the same address again
+  sendToLogPf(LOG_INFO, PSTR("IP address used for %u s without DHCP, starting the DHCP client"), (unsigned) saved.reused);
+  WiFi.config(IPAddress(), IPAddress(), IPAddress());
+  staticLease = false;
+}
@@ -0,0 +1,37 @@
+#ifndef WIFIFAST_H
+#define WIFIFAST_H
+
+#include <Arduino.h>
+
+/*
+ * Fast Wi-Fi connection after a restart
+ *
+ * The BSSID and channel of the access point, and the IP address, gateway,
+ * subnet mask and DNS server obtained from DHCP, are saved in the RTC user 
+ * memory once connected. After a restart, the station connects directly 
+ * to that access point without scanning, and with config.wifiFastConnect 
+ * set to 2 it reuses the IP address without waiting for DHCP. If that 
+ * fails, the saved data is erased and the usual WiFiManager connection 
+ * is used.
+ *
+ * A reused address is not renewed with the DHCP server, so the time it 
+ * has been used, across restarts, is kept with it. Once that time reaches 
+ * WIFI_LEASE_REUSE_MAX, the DHCP client is started in the background and 
+ * the next restart obtains a new lease instead of reusing the address.
+ */
+
+#define WIFI_FAST_TIMEOUT    3000  // ms, longest wait for the fast connection
+#define WIFI_LEASE_REUSE_MAX 1800  // s, shorter than the usual DHCP lease time
+
+// Tries to connect with the data saved before the restart, returns true 
+// if connected. 
+bool fastWifiConnect(void);
+
+// Saves the access point and IP configuration of the current connection
+void saveWifiConnection(void);
+
+// Updates the time the reused IP address has been in use and switches to 
+// DHCP once it reaches WIFI_LEASE_REUSE_MAX, to be called once a minute
+void checkWifiLease(void);
+
+#endif
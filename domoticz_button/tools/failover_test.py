@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+"""
+Measures the time a Domoticz button takes to switch to its backup MQTT broker
+when the first broker stops, and to return to the first broker once it is
+back.
+
+The script runs two mosquitto brokers and receives the log of the button as a
+syslog server. It repeatedly stops the first broker, waits for the button to
+report that its connection was restored on the backup broker, starts the first
+broker again and waits for the button to return to it.
+
+The button must be configured with mqttHost and mqttHost2 set to the address
+of this machine, mqttPort to --port, mqttPort2 to --port2, syslogHost to this
+machine, syslogPort to --syslog-port and logLevelSyslog to 6 (info) or more.
+The button only checks the first broker while its display is blanked, so the
+return time includes displayTimeout; do not touch the button during the test.
+
+Requires mosquitto in the PATH, nothing else.
+
+    ./failover_test.py --cycles 5
+"""
+
+import argparse
+import os
+import re
+import shutil
+import socket
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+CONNECTED = re.compile(r"Connected to MQTT broker (\S+) .* in (\d+) ms")
+RESTORED = re.compile(r"MQTT connection restored (\d+) ms after it was lost")
+
+
+def start_broker(port, workdir):
+    conf = os.path.join(workdir, "mosquitto%d.conf" % port)
+    with open(conf, "w") as f:
+        f.write("listener %d\nallow_anonymous true\n" % port)
+    return subprocess.Popen(["mosquitto", "-c", conf], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+
+def stop_broker(broker):
+    broker.terminate()
+    broker.wait(5)
+
+
+def wait_for(sock, pattern, timeout):
+    """Returns (time received, match) of the first log line matching pattern, or (None, None)"""
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        sock.settimeout(max(0.01, deadline - time.monotonic()))
+        try:
+            data, _ = sock.recvfrom(1024)
+        except socket.timeout:
+            break
+        line = data.decode("utf-8", "replace")
+        match = pattern.search(line)
+        if match:
+            return time.monotonic(), match
+    return None, None
+
+
+def summary(name, values):
+    if values:
+        print("%s: median %.0f ms, max %.0f ms" % (name, statistics.median(values), max(values)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--port", type=int, default=1883, help="MQTT port of the first broker")
+    parser.add_argument("--port2", type=int, default=1884, help="MQTT port of the backup broker")
+    parser.add_argument("--syslog-port", type=int, default=5514, help="UDP port on which the log of the button is received")
+    parser.add_argument("--cycles", type=int, default=5, help="number of stops of the first broker")
+    parser.add_argument("--timeout", type=float, default=180.0, help="longest wait for the button (s)")
+    args = parser.parse_args()
+
+    if not shutil.which("mosquitto"):
+        sys.exit("mosquitto not found")
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", args.syslog_port))
+    workdir = tempfile.mkdtemp(prefix="failover_test")
+    primary = start_broker(args.port, workdir)
+    backup = start_broker(args.port2, workdir)
+
+    print("Waiting for the button to connect...")
+    if wait_for(sock, CONNECTED, args.timeout)[0] is None:
+        stop_broker(primary)
+        stop_broker(backup)
+        sys.exit("No connection reported by the button, check its syslog configuration")
+
+    failover, failback, button = [], [], []
+    try:
+        for cycle in range(1, args.cycles + 1):
+            stop_broker(primary)
+            stopped = time.monotonic()
+            restored, match = wait_for(sock, RESTORED, args.timeout)
+            primary = start_broker(args.port, workdir)
+            if restored is None:
+                print("cycle %d: no connection to the backup broker within %.0f s" % (cycle, args.timeout))
+                continue
+            failover.append((restored - stopped)*1000)
+            button.append(int(match.group(1)))
+            started = time.monotonic()
+            returned, match = wait_for(sock, RESTORED, args.timeout)
+            if returned is None:
+                print("cycle %d: failover %.0f ms (button: %d ms), no return to the first broker within %.0f s"
+                      % (cycle, failover[-1], button[-1], args.timeout))
+                continue
+            failback.append((returned - started)*1000)
+            print("cycle %d: failover %.0f ms (button: %d ms), back on the first broker %.0f ms after its restart (switch: %s ms)"
+                  % (cycle, failover[-1], button[-1], failback[-1], match.group(1)))
+    finally:
+        stop_broker(primary)
+        stop_broker(backup)
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    summary("broker stop to backup connection", failover)
+    summary("connection lost to restored, as seen by the button", button)
+    summary("broker restart to return (includes displayTimeout and the probe interval)", failback)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,51 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+/*
+ * The few parts of the ESP8266 Arduino core used by the modules built
+ * on the host. Flash strings are ordinary strings.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#define PROGMEM
+#define PGM_P const char*
+#define PSTR(s) (s)
+#define strlen_P strlen
+#define memcpy_P memcpy
+
+// not in glibc before 2.38
+inline size_t hostStrlcpy(char* dst, const char* src, size_t size) {
+  size_t len = strlen(src);
+  if (size) {
+    size_t n = (len < size) ? len : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = 0;
+  }
+  return len;
+}
+#define strlcpy hostStrlcpy
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buf, size_t size) {
+      size_t n = 0;
+      while (size--)
+        n += write(*buf++);
+      return n;
+    }
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+#endif
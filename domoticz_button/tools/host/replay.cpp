@@ -0,0 +1,172 @@
+/*
+ * Replays recorded Domoticz status messages through the scanners of
+ * domoscan.cpp and reports the time taken for each message on the host.
+ *
+ * The messages are read from a file in the format printed by
+ *
+ *     mosquitto_sub -t domoticz/out
+ *
+ * each message ending with a line holding only "}". When built with
+ * ARDUINOJSON set to the src directory of ArduinoJson 6 (see the Makefile),
+ * the messages are also decoded with deserializeJson() as receivingMQTT()
+ * did before the filter (a document of mqttBufferSize bytes for each
+ * message) and as it does now (one small document with a filter, only for
+ * the messages accepted by scanDomoMessage()).
+ *
+ *     ./build/replay [payloads.txt [repeat]]
+ *
+ * Times are those of the host, only their ratios are meaningful for the
+ * ESP8266.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "devices.h"
+#include "domoscan.h"
+#ifdef HOST_ARDUINOJSON
+#include <ArduinoJson.h>
+#endif
+
+static std::vector<std::string> readMessages(const char* path) {
+  std::vector<std::string> messages;
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+  std::string message;
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    message += line;
+    if (!strcmp(line, "}\n") || !strcmp(line, "}")) {
+      if (message.back() == '\n')
+        message.pop_back();  // added by mosquitto_sub
+      messages.push_back(message);
+      message.clear();
+    }
+  }
+  fclose(f);
+  return messages;
+}
+
+// Average time of f() in nanoseconds
+template <typename F> static double timeOf(F f, int repeat) {
+  auto start = std::chrono::steady_clock::now();
+  for (int n = 0; n < repeat; n++)
+    f();
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / repeat;
+}
+
+int main(int argc, char* argv[]) {
+  const char* path = (argc > 1) ? argv[1] : "payloads.txt";
+  int repeat = (argc > 2) ? atoi(argv[2]) : 20000;
+  std::vector<std::string> messages = readMessages(path);
+  if (messages.empty() || repeat < 1) {
+    fprintf(stderr, "no messages in %s\n", path);
+    return 1;
+  }
+
+  size_t totalBytes = 0;
+  size_t maxBytes = 0;
+  int accepted = 0;
+  int mismatches = 0;
+  double scanTime = 0;
+  double streamTime = 0;
+  double acceptedScanTime = 0;
+  double rejectedScanTime = 0;
+  DomoStream stream;
+  volatile bool sink;
+
+#ifdef HOST_ARDUINOJSON
+  // as in receivingMQTT(), see main.cpp
+  const size_t mqttBufferSize = 768;
+  StaticJsonDocument<JSON_OBJECT_SIZE(4)> filter;
+  filter["nvalue"] = true;
+  filter["Level"] = true;
+  filter["svalue1"] = true;
+  filter["Status"] = true;
+  DynamicJsonDocument rxDoc(JSON_OBJECT_SIZE(4 + 3));
+  std::vector<char> buf;
+  double fullTime = 0;
+  double filteredTime = 0;
+  double copyTime = 0;
+  double acceptedCopyTime = 0;
+  size_t maxFullUsage = 0;
+  size_t maxFilteredUsage = 0;
+  int parseErrors = 0;
+#endif
+
+  for (const std::string& message : messages) {
+    const char* payload = message.data();
+    unsigned int length = message.size();
+    totalBytes += length;
+    if (length > maxBytes)
+      maxBytes = length;
+
+    domoScan_t scan;
+    bool ok = scanDomoMessage(payload, length, &scan);
+    double t = timeOf([&] { sink = scanDomoMessage(payload, length, &scan); }, repeat);
+    scanTime += t;
+    if (ok) {
+      accepted++;
+      acceptedScanTime += t;
+    } else
+      rejectedScanTime += t;
+
+    domoScan_t streamScan;
+    domoFields_t fields;
+    streamTime += timeOf([&] {
+      stream.reset();
+      for (unsigned int n = 0; n < length; n++)
+        stream.write(payload[n]);  // one byte at a time as PubSubClient does
+      sink = stream.result(&streamScan, &fields);
+    }, repeat);
+    if (streamScan.idx != scan.idx || streamScan.type != scan.type)
+      mismatches++;
+
+#ifdef HOST_ARDUINOJSON
+    // the payload is decoded in place, so each parse works on a fresh copy
+    buf.resize(length);
+    double copy = timeOf([&] { memcpy(buf.data(), payload, length); }, repeat);
+    copyTime += copy;
+    fullTime += timeOf([&] {
+      memcpy(buf.data(), payload, length);
+      DynamicJsonDocument doc(mqttBufferSize);
+      if (deserializeJson(doc, buf.data(), length))
+        parseErrors++;
+      if (doc.memoryUsage() > maxFullUsage)
+        maxFullUsage = doc.memoryUsage();
+    }, repeat);
+    if (ok) {
+      acceptedCopyTime += copy;
+      filteredTime += timeOf([&] {
+        memcpy(buf.data(), payload, length);
+        if (deserializeJson(rxDoc, buf.data(), length, DeserializationOption::Filter(filter)))
+          parseErrors++;
+        if (rxDoc.memoryUsage() > maxFilteredUsage)
+          maxFilteredUsage = rxDoc.memoryUsage();
+      }, repeat);
+    }
+#endif
+  }
+  (void) sink;
+
+  size_t count = messages.size();
+  printf("%zu messages, %zu bytes on average, %zu at most, %d accepted\n", count, totalBytes / count, maxBytes, accepted);
+  printf("scanDomoMessage(): %.0f ns per message (accepted %.0f ns, rejected %.0f ns)\n", scanTime / count,
+    (accepted) ? acceptedScanTime / accepted : 0.0, (count > (size_t) accepted) ? rejectedScanTime / (count - accepted) : 0.0);
+  printf("DomoStream: %.0f ns per message, %zu bytes of state, %d results different from scanDomoMessage()\n",
+    streamTime / count, sizeof(DomoStream), mismatches);
+#ifdef HOST_ARDUINOJSON
+  printf("deserializeJson(), document of %zu bytes for each message: %.0f ns per message, %zu bytes used at most\n",
+    mqttBufferSize, (fullTime - copyTime) / count, maxFullUsage);
+  printf("deserializeJson() with filter, one document of %zu bytes: %.0f ns per message (scan included), %zu bytes used at most\n",
+    rxDoc.capacity(), (scanTime + filteredTime - acceptedCopyTime) / count, maxFilteredUsage);
+  if (parseErrors)
+    printf("%d deserializeJson() errors\n", parseErrors / repeat);
+#endif
+  return (mismatches) ? 1 : 0;
+}
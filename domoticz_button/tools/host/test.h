@@ -0,0 +1,20 @@
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+/*
+ * Minimal checks for the host tests: a failed CHECK() prints its location
+ * and the test program returns the number of failures.
+ */
+
+#include <cstdio>
+
+extern int testFailures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      testFailures++; \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+    } \
+  } while (0)
+
+#endif
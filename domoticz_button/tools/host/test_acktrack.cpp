@@ -0,0 +1,116 @@
+#include "test.h"
+#include "acktrack.h"
+#include "rxqueue.h"
+
+static ackrecord_t command(uint16_t index, devtype_t type, uint8_t status, uint8_t prevStatus, uint32_t time) {
+  ackrecord_t rec = {index, (uint8_t) type, status, -1, prevStatus, -1, time};
+  return rec;
+}
+
+// Removes all records published before now
+static void drain(uint32_t now) {
+  ackrecord_t rec;
+  while (ackExpired(now, 0, rec))
+    ;
+  memset(ackLatency, 0, sizeof(ackLatency));
+}
+
+static void testAcknowledgement(void) {
+  drain(0);
+  CHECK(ackPush(command(1, DT_SWITCH, DS_ON, DS_OFF, 1000)));
+  CHECK(ackPush(command(2, DT_DIMMER, DS_ON, DS_OFF, 1000)));
+  CHECK(ackPending() == 2);
+  ackrecord_t* rec = ackFind(2);
+  CHECK(rec && rec->index == 2 && rec->type == DT_DIMMER && rec->status == DS_ON);
+  CHECK(!ackFind(3));
+
+  CHECK(ackDone(1, 1120) == 120);
+  CHECK(!ackFind(1) && ackPending() == 1);
+  CHECK(ackDone(1, 1200) == 0);  // already acknowledged
+  CHECK(ackDone(2, 1030) == 30);
+  CHECK(ackPending() == 0);
+
+  // 120 ms is in the [100, 200) bucket, 30 ms in the first one
+  CHECK(ackLatency[DT_SWITCH].acked == 1 && ackLatency[DT_SWITCH].counts[2] == 1);
+  CHECK(ackLatency[DT_SWITCH].totalLatency == 120 && ackLatency[DT_SWITCH].maxLatency == 120);
+  CHECK(ackLatency[DT_DIMMER].acked == 1 && ackLatency[DT_DIMMER].counts[0] == 1);
+
+  // longer than the last limit
+  ackPush(command(1, DT_SWITCH, DS_ON, DS_OFF, 0));
+  CHECK(ackDone(1, 5000) == 5000);
+  CHECK(ackLatency[DT_SWITCH].counts[ACK_BUCKETS - 1] == 1 && ackLatency[DT_SWITCH].maxLatency == 5000);
+}
+
+static void testReplace(void) {
+  drain(0);
+  ackPush(command(1, DT_SWITCH, DS_ON, DS_OFF, 100));
+  CHECK(ackPush(command(1, DT_SWITCH, DS_OFF, DS_ON, 200)));  // toggled again before the acknowledgement
+  CHECK(ackPending() == 1 && ackLatency[DT_SWITCH].replaced == 1);
+  ackrecord_t* rec = ackFind(1);
+  CHECK(rec && rec->status == DS_OFF && rec->time == 200);
+  CHECK(rec && rec->prevStatus == DS_OFF);  // the status before the first command is restored on timeout
+}
+
+static void testExpiry(void) {
+  drain(0);
+  ackPush(command(1, DT_SWITCH, DS_ON, DS_OFF, 100));
+  ackPush(command(2, DT_GROUP, DS_ON, DS_MIXED, 900));
+  ackrecord_t rec;
+  CHECK(!ackExpired(1000, 1000, rec));
+  CHECK(ackExpired(1101, 1000, rec));
+  CHECK(rec.index == 1 && rec.prevStatus == DS_OFF);
+  CHECK(!ackExpired(1101, 1000, rec));
+  CHECK(ackPending() == 1 && ackLatency[DT_SWITCH].timedOut == 1);
+
+  // full table: the oldest record is dropped, also when millis() wraps around
+  drain(1000);
+  uint32_t start = 0xFFFFFFF0;
+  for (uint16_t n = 0; n < ACK_SLOTS; n++)
+    CHECK(ackPush(command(n, DT_SWITCH, DS_ON, DS_OFF, start + 4*n)));
+  CHECK(!ackPush(command(20, DT_DIMMER, DS_ON, DS_OFF, start + 4*ACK_SLOTS)));
+  CHECK(ackPending() == ACK_SLOTS && !ackFind(0) && ackFind(1) && ackFind(20));
+  CHECK(ackLatency[DT_SWITCH].timedOut == 1);
+  drain(start + 4*ACK_SLOTS + 1);
+  CHECK(ackPending() == 0);
+}
+
+static rxrecord_t status(uint16_t index, uint8_t status) {
+  rxrecord_t rec = {index, status, 0};
+  return rec;
+}
+
+// Statuses received for a device that is already in the queue replace the
+// pending one, which keeps its place
+static void testRxQueue(void) {
+  rxClear();
+  rxQueueStats = {0, 0, 0, 0};
+  rxrecord_t rec;
+  CHECK(!rxPop(rec));
+
+  CHECK(rxPush(status(1, DS_ON)));
+  CHECK(rxPush(status(2, DS_ON)));
+  CHECK(rxPush(status(1, DS_OFF)));
+  CHECK(rxPush(status(3, DS_ON)));
+  CHECK(rxPending() == 3 && rxQueueStats.coalesced == 1 && rxQueueStats.pushed == 3);
+  CHECK(rxPop(rec) && rec.index == 1 && rec.status == DS_OFF);
+  CHECK(rxPop(rec) && rec.index == 2);
+  CHECK(rxPop(rec) && rec.index == 3);
+  CHECK(!rxPop(rec));
+
+  // full queue: new devices are dropped, pending ones are still updated
+  for (uint16_t n = 0; n < RX_QUEUE_SIZE; n++)
+    CHECK(rxPush(status(n, DS_ON)));
+  CHECK(!rxPush(status(100, DS_ON)));
+  CHECK(rxPush(status(5, DS_OFF)));
+  CHECK(rxQueueStats.dropped == 1 && rxQueueStats.highWater == RX_QUEUE_SIZE);
+  for (uint16_t n = 0; n < RX_QUEUE_SIZE; n++)
+    CHECK(rxPop(rec) && rec.index == n && rec.status == ((n == 5) ? DS_OFF : DS_ON));
+  CHECK(rxPending() == 0);
+}
+
+void testAckTrack(void) {
+  testAcknowledgement();
+  testReplace();
+  testExpiry();
+  testRxQueue();
+}
@@ -0,0 +1,57 @@
+#include <string>
+#include "test.h"
+#include "config.h"
+#include "devices.h"
+#include "domocmd.h"
+
+// the devices used by encodeCommand(), see devices.cpp
+device_t devices[] = {
+  {DS_OFF,  0, 31,         DT_SWITCH,   Z_HOUSE, "switch"},
+  {DS_OFF,  0, 4294967295, DT_DIMMER,   Z_HOUSE, "dimmer"},
+  {DS_NONE, 0, 28,         DT_PUSH_OFF, Z_HOUSE, "push off", DF_PUBLISH_OUT},
+  {DS_NONE, 0, 12,         DT_SCENE,    Z_HOUSE, "scene"},
+  {DS_OFF,  0, 3,          DT_GROUP,    Z_HOUSE, "group"},
+  {DS_OFF,  0, 7,          DT_SELECTOR, Z_HOUSE, "selector"},
+  {DS_OFF,  0, 4,          DT_CONTACT,  Z_HOUSE, "contact"}
+};
+const uint16_t deviceCount = sizeof(devices)/sizeof(device_t);
+
+// Encodes into a buffer larger than CMD_SZ and checks that nothing is
+// written past CMD_SZ bytes
+static std::string encode(int dev, int32_t value, bool isLevel, const char** topic) {
+  char buf[CMD_SZ + 16];
+  memset(buf, 0x55, sizeof(buf));
+  size_t len = encodeCommand(buf, dev, value, isLevel, topic);
+  CHECK(len < CMD_SZ);
+  for (size_t n = CMD_SZ; n < sizeof(buf); n++)
+    CHECK(buf[n] == 0x55);
+  if (!len)
+    return "";
+  CHECK(buf[len] == 0 && strlen(buf) == len);
+  return std::string(buf, len);
+}
+
+void testDomoCmd(void) {
+  const char* topic;
+
+  CHECK(encode(0, 1, false, &topic) == "{\"command\":\"switchlight\", \"idx\":31, \"switchcmd\":\"On\"}");
+  CHECK(!strcmp(topic, DOMO_SUB_TOPIC));
+  CHECK(encode(0, 0, false, &topic) == "{\"command\":\"switchlight\", \"idx\":31, \"switchcmd\":\"Off\"}");
+  CHECK(encode(0, 50, true, &topic) == "{\"command\":\"switchlight\", \"idx\":31, \"switchcmd\":\"On\"}");  // any level turns it on
+
+  // longest idx and level: the command must still fit in CMD_SZ
+  CHECK(encode(1, 0, false, &topic) == "{\"command\":\"switchlight\", \"idx\":4294967295, \"switchcmd\":\"Off\"}");
+  CHECK(encode(1, 45, true, &topic) == "{\"command\":\"switchlight\", \"idx\":4294967295, \"switchcmd\":\"Set Level\", \"level\":45}");
+  CHECK(encode(1, INT32_MIN, true, &topic) ==
+    "{\"command\":\"switchlight\", \"idx\":4294967295, \"switchcmd\":\"Set Level\", \"level\":-2147483648}");
+  CHECK(encode(5, 30, true, &topic) == "{\"command\":\"switchlight\", \"idx\":7, \"switchcmd\":\"Set Level\", \"level\":30}");
+
+  // push off button with DF_PUBLISH_OUT: status message sent directly
+  CHECK(encode(2, 1, false, &topic) == "{ \"idx\" : 28, \"nvalue\" : 0 }");
+  CHECK(!strcmp(topic, DOMO_PUB_TOPIC));
+
+  CHECK(encode(3, 1, false, &topic) == "{\"command\":\"switchscene\", \"idx\":12, \"switchcmd\":\"On\"}");
+  CHECK(encode(3, 0, false, &topic) == "");  // a scene cannot be turned off
+  CHECK(encode(4, 0, false, &topic) == "{\"command\":\"switchscene\", \"idx\":3, \"switchcmd\":\"Off\"}");
+  CHECK(encode(6, 1, false, &topic) == "");  // a contact cannot be set
+}
@@ -0,0 +1,103 @@
+#include "test.h"
+#include "devices.h"
+#include "domoscan.h"
+
+static bool scan(const char* payload, domoScan_t* result) {
+  return scanDomoMessage(payload, strlen(payload), result);
+}
+
+static void testDeviceType(void) {
+  CHECK(domoDeviceType("On/Off", 6) == DT_SWITCH);
+  CHECK(domoDeviceType("Dimmer", 6) == DT_DIMMER);
+  CHECK(domoDeviceType("Contact", 7) == DT_CONTACT);
+  CHECK(domoDeviceType("Selector", 8) == DT_SELECTOR);
+  CHECK(domoDeviceType("Group", 5) == DT_GROUP);
+  CHECK(domoDeviceType("On/Off switch", 6) == DT_SWITCH);  // not null terminated
+  CHECK(domoDeviceType("Scene", 5) == -1);
+  CHECK(domoDeviceType("Motion Sensor", 13) == -1);
+  CHECK(domoDeviceType("On/Of", 5) == -1);
+  CHECK(domoDeviceType("Oz/Off", 6) == -1);  // same length and first character as On/Off
+  CHECK(domoDeviceType("", 0) == -1);
+}
+
+static void testScanner(void) {
+  domoScan_t s;
+
+  CHECK(scan("{\n\t\"idx\" : 31,\n\t\"name\" : \"Lampe\",\n\t\"switchType\" : \"On/Off\"\n}", &s));
+  CHECK(s.idx == 31 && s.type == DT_SWITCH);
+
+  // scenes and groups: idx in a string, type in "Type"
+  CHECK(scan("{\"Name\":\"Cuisine\",\"Status\":\"Mixed\",\"Type\":\"Group\",\"idx\":\"3\"}", &s));
+  CHECK(s.idx == 3 && s.type == DT_GROUP);
+
+  // switchType has priority over Type whatever their order
+  CHECK(scan("{\"Type\":\"Group\",\"idx\":7,\"switchType\":\"Dimmer\"}", &s));
+  CHECK(s.idx == 7 && s.type == DT_DIMMER);
+  CHECK(!scan("{\"switchType\":\"Motion Sensor\",\"Type\":\"Group\",\"idx\":7}", &s));
+  CHECK(s.idx == 7 && s.type == -1);
+
+  // unrelated devices and invalid messages
+  CHECK(!scan("{\"dtype\":\"Temp\",\"idx\":201,\"svalue1\":\"21.3\"}", &s));
+  CHECK(s.idx == 201 && s.type == -1);
+  CHECK(!scan("{\"idx\":0,\"switchType\":\"On/Off\"}", &s));
+  CHECK(!scan("[\"idx\",5]", &s));
+  CHECK(!scan("", &s));
+  CHECK(s.idx == 0 && s.type == -1);
+
+  // the payload does not need to be null terminated
+  const char* twice = "{\"idx\":12,\"switchType\":\"Selector\"}{\"idx\":99}";
+  CHECK(scanDomoMessage(twice, 35, &s));
+  CHECK(s.idx == 12 && s.type == DT_SELECTOR);
+  CHECK(!scanDomoMessage(twice, 20, &s));  // truncated
+  CHECK(s.idx == 12 && s.type == -1);
+
+  // nested values and strings containing JSON are skipped over
+  CHECK(scan("{\"data\":{\"idx\":1,\"switchType\":\"Group\",\"list\":[1,{\"x\":\"}]\"}]},"
+    "\"text\":\"\\\"idx\\\":2,\",\"idx\":4,\"switchType\":\"Contact\"}", &s));
+  CHECK(s.idx == 4 && s.type == DT_CONTACT);
+}
+
+static void testEscapedKeys(void) {
+  domoScan_t s;
+
+  // escaped quotes in a key do not end it, so "i\"dx" is not "idx"
+  CHECK(scan("{\"i\\\"dx\":5,\"idx\":6,\"switchType\":\"On/Off\"}", &s));
+  CHECK(s.idx == 6);
+  CHECK(scan("{\"\\\"idx\\\"\":5,\"idx\":6,\"switchType\":\"On/Off\"}", &s));
+  CHECK(s.idx == 6);
+
+  // a key ending with an escaped backslash
+  CHECK(scan("{\"name\\\\\":\"x\",\"idx\":8,\"switchType\":\"On/Off\"}", &s));
+  CHECK(s.idx == 8 && s.type == DT_SWITCH);
+
+  // escape sequences are not decoded: "\u0069dx" is not taken for "idx"
+  CHECK(!scan("{\"\\u0069dx\":5,\"switchType\":\"On/Off\"}", &s));
+  CHECK(s.idx == 0);
+}
+
+static void testStateMessage(void) {
+  bool scene;
+  uint32_t idx;
+  domoFields_t f;
+
+  CHECK(scanStateMessage("device/12", "1", 1, &scene, &idx, &f));
+  CHECK(!scene && idx == 12 && f.nvalue == 1 && f.level == 0);
+  CHECK(scanStateMessage("device/5", "2,-40", 5, &scene, &idx, &f));
+  CHECK(f.nvalue == 2 && f.level == -40 && f.svalue1 == -40);
+  CHECK(scanStateMessage("scene/3", "Mixed", 5, &scene, &idx, &f));
+  CHECK(scene && idx == 3 && !strcmp(f.status, "Mixed"));
+  CHECK(scanStateMessage("scene/3", "Unexpected", 10, &scene, &idx, &f));
+  CHECK(!strcmp(f.status, "Unexpec"));  // truncated to fit
+  CHECK(!scanStateMessage("device/5", "", 0, &scene, &idx, &f));
+  CHECK(!scanStateMessage("device/5", "on", 2, &scene, &idx, &f));
+  CHECK(!scanStateMessage("device/5", "1,", 2, &scene, &idx, &f));
+  CHECK(!scanStateMessage("device/x", "1", 1, &scene, &idx, &f));
+  CHECK(!scanStateMessage("light/5", "1", 1, &scene, &idx, &f));
+}
+
+void testDomoScan(void) {
+  testDeviceType();
+  testScanner();
+  testEscapedKeys();
+  testStateMessage();
+}
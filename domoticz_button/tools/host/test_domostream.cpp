@@ -0,0 +1,125 @@
+#include <string>
+#include "test.h"
+#include "devices.h"
+#include "domoscan.h"
+
+static void feed(DomoStream& stream, const char* data, size_t len) {
+  for (size_t n = 0; n < len; n++)
+    stream.write(data[n]);  // one byte at a time as PubSubClient does
+}
+
+static bool streamScan(const std::string& payload, domoScan_t* scan, domoFields_t* fields) {
+  DomoStream stream;
+  feed(stream, payload.data(), payload.size());
+  return stream.result(scan, fields);
+}
+
+static const char* messages[] = {
+  "{\n\t\"Battery\" : 255,\n\t\"Level\" : 45,\n\t\"idx\" : 2,\n\t\"nvalue\" : 2,\n\t\"svalue1\" : \"45\",\n\t\"switchType\" : \"Dimmer\"\n}",
+  "{\"Name\":\"Cuisine\",\"Status\":\"Mixed\",\"Type\":\"Group\",\"idx\":\"3\"}",
+  "{\"Type\":\"Group\",\"idx\":7,\"switchType\":\"Selector\",\"svalue1\":\"-20\",\"nvalue\":0}",
+  "{\"dtype\":\"Temp\",\"idx\":201,\"svalue1\":\"21.3\"}",
+  "{\"data\":{\"idx\":1,\"list\":[1,{\"x\":\"}]\"}]},\"text\":\"\\\"idx\\\":2,\",\"idx\":4,\"switchType\":\"Contact\"}",
+  "{\"idx\":5}",
+  "[\"idx\",5]",
+  "",
+};
+
+// The stream gives the same idx and type as scanDomoMessage() wherever the
+// payload is split between successive writes
+static void testSplitChunks(void) {
+  for (const char* message : messages) {
+    size_t len = strlen(message);
+    domoScan_t expected;
+    bool ok = scanDomoMessage(message, len, &expected);
+    DomoStream stream;
+    for (size_t split = 0; split <= len; split++) {
+      domoScan_t scan;
+      domoFields_t fields;
+      stream.reset();
+      feed(stream, message, split);
+      stream.result(&scan, &fields);  // partial result, must not disturb the rest
+      feed(stream, message + split, len - split);
+      CHECK(stream.count() == len);
+      CHECK(stream.result(&scan, &fields) == ok);
+      CHECK(scan.idx == expected.idx && scan.type == expected.type);
+    }
+  }
+}
+
+static void testFields(void) {
+  domoScan_t scan;
+  domoFields_t f;
+
+  CHECK(streamScan(messages[0], &scan, &f));
+  CHECK(scan.idx == 2 && scan.type == DT_DIMMER && f.nvalue == 2 && f.level == 45 && f.svalue1 == 45);
+  CHECK(streamScan(messages[1], &scan, &f));
+  CHECK(scan.type == DT_GROUP && !strcmp(f.status, "Mixed"));
+  CHECK(streamScan(messages[2], &scan, &f));
+  CHECK(scan.type == DT_SELECTOR && f.svalue1 == -20 && f.nvalue == 0 && f.level == 0);
+  CHECK(streamScan("{\"idx\":5,\"switchType\":\"On/Off\",\"nvalue\":1}", &scan, &f));  // scalar ended by '}'
+  CHECK(f.nvalue == 1);
+
+  // the stream is ready for the next message after reset()
+  DomoStream stream;
+  feed(stream, messages[0], strlen(messages[0]));
+  stream.reset();
+  CHECK(stream.count() == 0);
+  CHECK(!stream.result(&scan, &f));
+  CHECK(scan.idx == 0 && scan.type == -1 && f.nvalue == 0 && f.level == 0 && f.status[0] == 0);
+}
+
+static void testEscapedKeys(void) {
+  domoScan_t scan;
+  domoFields_t f;
+
+  // escaped quotes in a key do not end it, so "i\"dx" is not "idx"
+  CHECK(streamScan("{\"i\\\"dx\":5,\"idx\":6,\"switchType\":\"On/Off\"}", &scan, &f));
+  CHECK(scan.idx == 6);
+  CHECK(streamScan("{\"\\\"idx\\\"\":5,\"idx\":6,\"switchType\":\"On/Off\"}", &scan, &f));
+  CHECK(scan.idx == 6);
+
+  // a key ending with an escaped backslash
+  CHECK(streamScan("{\"name\\\\\":\"x\",\"idx\":8,\"switchType\":\"On/Off\"}", &scan, &f));
+  CHECK(scan.idx == 8 && scan.type == DT_SWITCH);
+
+  // escape sequences are not decoded: "\u0069dx" is not taken for "idx"
+  CHECK(!streamScan("{\"\\u0069dx\":5,\"switchType\":\"On/Off\"}", &scan, &f));
+  CHECK(scan.idx == 0);
+
+  // an escaped quote in a value
+  CHECK(streamScan("{\"name\":\"\\\"idx\\\":9\",\"idx\":8,\"switchType\":\"On/Off\"}", &scan, &f));
+  CHECK(scan.idx == 8);
+}
+
+// Keys and values longer than the buffers of the stream
+static void testLongValues(void) {
+  domoScan_t scan;
+  domoFields_t f;
+
+  // a message much larger than mqttBufferSize
+  std::string names(2000, 'x');
+  CHECK(streamScan("{\"LevelNames\":\"" + names + "\",\"idx\":5,\"switchType\":\"Selector\",\"svalue1\":\"30\"}", &scan, &f));
+  CHECK(scan.idx == 5 && scan.type == DT_SELECTOR && f.svalue1 == 30);
+
+  // keys longer than SCAN_KEY_SZ that start like a key of interest
+  CHECK(streamScan("{\"switchTypeOfTheDevice\":\"Group\",\"idx\":5,\"idxxxxxxxxxxxxxxxx\":6,\"switchType\":\"On/Off\"}", &scan, &f));
+  CHECK(scan.idx == 5 && scan.type == DT_SWITCH);
+
+  // values longer than SCAN_VALUE_SZ are ignored, not truncated
+  CHECK(!streamScan("{\"idx\":123456789012,\"switchType\":\"On/Off\"}", &scan, &f));
+  CHECK(scan.idx == 0);
+  CHECK(!streamScan("{\"idx\":5,\"switchType\":\"On/Off switch 2\"}", &scan, &f));
+  CHECK(scan.type == -1);
+  CHECK(streamScan("{\"idx\":5,\"switchType\":\"On/Off\",\"nvalue\":1,\"Level\":\"100000000000\"}", &scan, &f));
+  CHECK(f.nvalue == 1 && f.level == 0);
+  CHECK(streamScan("{\"idx\":\"3\",\"Type\":\"Group\",\"Status\":\"Unexpected\"}", &scan, &f));
+  CHECK(!strcmp(f.status, "Unexpec"));  // fits the value buffer, truncated to fit status
+}
+
+void testDomoStream(void) {
+  testSplitChunks();
+  testFields();
+  testEscapedKeys();
+  testLongValues();
+}
@@ -0,0 +1,22 @@
+#include "test.h"
+
+int testFailures = 0;
+
+void testDomoScan(void);
+void testDomoStream(void);
+void testDomoCmd(void);
+void testTxQueue(void);
+void testAckTrack(void);
+
+int main() {
+  testDomoScan();
+  testDomoStream();
+  testDomoCmd();
+  testTxQueue();
+  testAckTrack();
+  if (testFailures)
+    printf("%d failed checks\n", testFailures);
+  else
+    printf("all checks passed\n");
+  return (testFailures) ? 1 : 0;
+}
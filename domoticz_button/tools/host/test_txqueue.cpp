@@ -0,0 +1,99 @@
+#include "test.h"
+#include "txqueue.h"
+
+static void reset(void) {
+  txClear();
+  txQueueStats = {0, 0, 0, 0, 0};
+}
+
+static txrecord_t command(uint16_t index, int32_t value, uint32_t time) {
+  txrecord_t rec = {index, false, value, time};
+  return rec;
+}
+
+// Pops all the pending commands and checks their devices against indexes
+static void checkOrder(const uint16_t* indexes, uint16_t count) {
+  txrecord_t rec;
+  CHECK(txPending() == count);
+  for (uint16_t n = 0; n < count; n++) {
+    CHECK(txPeek(rec) && rec.index == indexes[n]);
+    txPop();
+  }
+  CHECK(!txPeek(rec));
+  CHECK(txPending() == 0);
+}
+
+static void testOrder(void) {
+  reset();
+  txrecord_t rec;
+  CHECK(!txPeek(rec));
+  txPop();  // nothing to remove
+  CHECK(txPending() == 0);
+
+  for (uint16_t n = 0; n < 3; n++)
+    CHECK(txPush(command(n, 1, 100 + n)));
+  CHECK(txPeek(rec) && rec.index == 0 && rec.time == 100);
+  CHECK(txPending() == 3);  // peek does not remove
+  const uint16_t expected[] = {0, 1, 2};
+  checkOrder(expected, 3);
+  CHECK(txQueueStats.queued == 3 && txQueueStats.dropped == 0 && txQueueStats.collapsed == 0);
+}
+
+static void testDropOldest(void) {
+  reset();
+  for (uint16_t n = 0; n < TX_QUEUE_SIZE; n++)
+    CHECK(txPush(command(n, 1, n)));
+  CHECK(!txPush(command(20, 1, 20)));
+  CHECK(!txPush(command(21, 1, 21)));
+  CHECK(txQueueStats.dropped == 2 && txQueueStats.queued == TX_QUEUE_SIZE + 2);
+
+  uint16_t expected[TX_QUEUE_SIZE];
+  for (uint16_t n = 0; n < TX_QUEUE_SIZE - 2; n++)
+    expected[n] = n + 2;
+  expected[TX_QUEUE_SIZE - 2] = 20;
+  expected[TX_QUEUE_SIZE - 1] = 21;
+  checkOrder(expected, TX_QUEUE_SIZE);
+}
+
+static void testCollapse(void) {
+  reset();
+  txPush(command(1, 10, 0));
+  txPush(command(2, 20, 1));
+  txPush(command(3, 30, 2));
+  CHECK(txPush(command(1, 11, 3)));  // replaces the first command and moves to the end
+  CHECK(txQueueStats.collapsed == 1 && txPending() == 3);
+  txrecord_t rec;
+  txPop();
+  txPop();
+  CHECK(txPeek(rec) && rec.index == 1 && rec.value == 11 && rec.time == 3);
+
+  // a command for a pending device does not drop anything when the queue is full
+  reset();
+  for (uint16_t n = 0; n < TX_QUEUE_SIZE; n++)
+    txPush(command(n, 1, n));
+  CHECK(txPush(command(0, 0, 50)));
+  CHECK(txQueueStats.dropped == 0 && txQueueStats.collapsed == 1);
+  uint16_t expected[TX_QUEUE_SIZE];
+  for (uint16_t n = 0; n < TX_QUEUE_SIZE - 1; n++)
+    expected[n] = n + 1;
+  expected[TX_QUEUE_SIZE - 1] = 0;
+  checkOrder(expected, TX_QUEUE_SIZE);
+
+  // collapsing across the end of the ring buffer
+  reset();
+  for (uint16_t n = 0; n < TX_QUEUE_SIZE - 2; n++) {
+    txPush(command(n, 1, n));
+    txPop();
+  }
+  for (uint16_t n = 0; n < 5; n++)
+    txPush(command(10 + n, 1, n));
+  txPush(command(11, 2, 9));
+  const uint16_t wrapped[] = {10, 12, 13, 14, 11};
+  checkOrder(wrapped, 5);
+}
+
+void testTxQueue(void) {
+  testOrder();
+  testDropOldest();
+  testCollapse();
+}
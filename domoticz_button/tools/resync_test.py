@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+"""
+Measures the time a Domoticz button takes to get back a consistent state
+after the MQTT broker restarts.
+
+The script runs its own mosquitto broker with persistence, so that retained
+messages survive the restarts, and receives the log of the button as a
+syslog server. It publishes a retained compact state for each device given
+with --idx, then repeatedly stops the broker, restarts it after --down
+seconds and waits for the button to report that it has the status of its
+devices again.
+
+The button must be configured with mqttHost set to the address of this
+machine, mqttPort to --port, syslogHost to this machine, syslogPort to
+--syslog-port, logLevelSyslog to 6 (info) or more and, to measure the
+retained state topics, mqttStateTopic to --state-topic. Run the script once
+with mqttStateTopic empty to compare with the status requests to Domoticz,
+which must then also be connected to this broker. Set mqttPersistent to 0,
+a resumed persistent session does not resynchronize.
+
+Requires mosquitto and mosquitto_pub in the PATH, nothing else.
+
+    ./resync_test.py --idx 1 2 3 4 --cycles 5
+"""
+
+import argparse
+import os
+import re
+import shutil
+import socket
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+CONNECTED = re.compile(r"Connected to MQTT broker .* in (\d+) ms")
+SYNCED = re.compile(r"Status of (\d+) of (\d+) devices received in (\d+) ms")
+
+
+def start_broker(port, workdir):
+    conf = os.path.join(workdir, "mosquitto.conf")
+    with open(conf, "w") as f:
+        f.write("listener %d\nallow_anonymous true\npersistence true\npersistence_location %s/\n" % (port, workdir))
+    return subprocess.Popen(["mosquitto", "-c", conf], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+
+def stop_broker(broker):
+    broker.terminate()
+    broker.wait(5)
+
+
+def publish_states(port, topic, indexes, payload):
+    for idx in indexes:
+        subprocess.run(["mosquitto_pub", "-p", str(port), "-r", "-t", "%s/device/%d" % (topic, idx), "-m", payload], check=True)
+
+
+def wait_for(sock, pattern, timeout):
+    """Returns (time received, match) of the first log line matching pattern, or (None, None)"""
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        sock.settimeout(max(0.01, deadline - time.monotonic()))
+        try:
+            data, _ = sock.recvfrom(1024)
+        except socket.timeout:
+            break
+        line = data.decode("utf-8", "replace")
+        match = pattern.search(line)
+        if match:
+            return time.monotonic(), match
+    return None, None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--port", type=int, default=1883, help="MQTT port of the test broker")
+    parser.add_argument("--syslog-port", type=int, default=5514, help="UDP port on which the log of the button is received")
+    parser.add_argument("--state-topic", default="domoticz/state", help="mqttStateTopic of the button")
+    parser.add_argument("--idx", type=int, nargs="*", default=[], help="Domoticz idx of the switches to publish a retained state for")
+    parser.add_argument("--payload", default="1", help="retained state published for each device")
+    parser.add_argument("--cycles", type=int, default=5, help="number of broker restarts")
+    parser.add_argument("--down", type=float, default=3.0, help="time the broker is stopped (s)")
+    parser.add_argument("--timeout", type=float, default=90.0, help="longest wait for the button (s)")
+    args = parser.parse_args()
+
+    for tool in ("mosquitto", "mosquitto_pub"):
+        if not shutil.which(tool):
+            sys.exit("%s not found" % tool)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", args.syslog_port))
+    workdir = tempfile.mkdtemp(prefix="resync_test")
+    broker = start_broker(args.port, workdir)
+    time.sleep(0.5)
+    if args.idx:
+        publish_states(args.port, args.state_topic, args.idx, args.payload)
+
+    print("Waiting for the button to connect...")
+    if wait_for(sock, SYNCED, args.timeout)[0] is None:
+        stop_broker(broker)
+        sys.exit("No status sync reported by the button, check its syslog configuration")
+
+    total, after_connect = [], []
+    try:
+        for cycle in range(1, args.cycles + 1):
+            stop_broker(broker)
+            time.sleep(args.down)
+            broker = start_broker(args.port, workdir)
+            restart = time.monotonic()
+            connected, _ = wait_for(sock, CONNECTED, args.timeout)
+            synced, match = wait_for(sock, SYNCED, args.timeout)
+            if connected is None or synced is None:
+                print("cycle %d: no answer from the button within %.0f s" % (cycle, args.timeout))
+                continue
+            total.append((synced - restart)*1000)
+            after_connect.append((synced - connected)*1000)
+            print("cycle %d: connected %.0f ms after the broker restart, %s of %s devices %.0f ms later (button: %s ms)"
+                  % (cycle, (connected - restart)*1000, match.group(1), match.group(2), after_connect[-1], match.group(3)))
+    finally:
+        stop_broker(broker)
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    if after_connect:
+        print("connection to consistent state: median %.0f ms, max %.0f ms" % (statistics.median(after_connect), max(after_connect)))
+        print("broker restart to consistent state: median %.0f ms, max %.0f ms (includes the reconnection delay of the button)"
+              % (statistics.median(total), max(total)))
+
+
+if __name__ == "__main__":
+    main()